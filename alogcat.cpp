@@ -0,0 +1,65 @@
+/*******************************************************************************
+ *                           Author: Petru Marginean                           *
+ *                          petru.marginean@gmail.com                          *
+ ******************************************************************************/
+
+// alogcat [-f] file... : writes ALog outputs to stdout, decompressing them if needed
+//   -f: keep following the last file while it is being written (like tail -f)
+
+#include "alogsink.h"
+#include "scopeexit.h"
+#include <unistd.h>
+#include <sys/stat.h>
+
+void cat(const char* fname, bool follow)
+{
+    FILE* fp = ENFORCE(fopen(fname, "r"))("Cannot open '")(fname)("'");
+    SCOPE_EXIT(fclose(fp));
+    // the format is known only after the first bytes got written
+    for (struct stat st; follow && fstat(fileno(fp), &st) == 0 && st.st_size < 4;)
+        usleep(100000);
+    if (!CompressedReader::isCompressed(fp))
+    {
+        char buffer[64 * 1024];
+        for (;;)
+        {
+            std::size_t n = fread(buffer, 1, sizeof(buffer), fp);
+            fwrite(buffer, 1, n, stdout);
+            if (n)
+                continue;
+            if (!follow)
+                break;
+            clearerr(fp);
+            fflush(stdout);
+            usleep(100000);
+        }
+        return;
+    }
+    CompressedReader reader(fp);
+    std::string block;
+    for (;;)
+    {
+        if (reader.next(block))
+        {
+            fwrite(block.data(), 1, block.size(), stdout);
+            continue;
+        }
+        if (!follow)
+            break;
+        fflush(stdout);
+        usleep(100000);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    STD_FUNCTION_BEGIN;
+    bool follow = argc > 1 && std::string(argv[1]) == "-f";
+    int first = follow ? 2 : 1;
+    ENFORCE(first < argc)("Usage: ")(argv[0])(" [-f] file...");
+    for (int i = first; i != argc; ++i)
+        cat(argv[i], follow && i == argc - 1);
+    return 0;
+    STD_FUNCTION_END;
+    return -1;
+}
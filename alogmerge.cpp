@@ -0,0 +1,130 @@
+/*******************************************************************************
+ *                           Author: Petru Marginean                           *
+ *                          petru.marginean@gmail.com                          *
+ ******************************************************************************/
+
+// alogmerge segment... : merges ALog segment files (plain or compressed) into a
+// single stream ordered by timestamp; each segment must be ordered already.
+// Lines without a timestamp (e.g. flight recorder headers) stay after the line
+// that precedes them in their segment.
+
+#include "alogsink.h"
+#include <vector>
+#include <queue>
+
+struct LineReader
+{
+    explicit LineReader(const char* fname);
+    ~LineReader();
+    bool next(); // reads the next line in line_ and its timestamp in key_
+    std::string line_, key_;
+private:
+    LineReader(const LineReader&);
+    bool fill();
+private:
+    FILE* fp_;
+    bool compressed_;
+    std::string buffer_;
+    std::size_t pos_;
+};
+
+inline LineReader::LineReader(const char* fname) : pos_(0)
+{
+    fp_ = ENFORCE(fopen(fname, "r"))("Cannot open '")(fname)("'");
+    compressed_ = CompressedReader::isCompressed(fp_);
+}
+
+inline LineReader::~LineReader()
+{
+    fclose(fp_);
+}
+
+inline bool LineReader::fill()
+{
+    buffer_.erase(0, pos_);
+    pos_ = 0;
+    if (compressed_)
+    {
+        std::string block;
+        if (!CompressedReader(fp_).next(block))
+            return false;
+        buffer_ += block;
+        return true;
+    }
+    char data[64 * 1024];
+    std::size_t n = fread(data, 1, sizeof(data), fp_);
+    buffer_.append(data, n);
+    return n != 0;
+}
+
+// "YYYY-MM-DD HH:MM:SS.nnnnnnnnn" sorts as text
+inline bool hasTimestamp(const std::string& line)
+{
+    return line.size() >= 29 && line[4] == '-' && line[10] == ' ' && line[19] == '.';
+}
+
+inline bool LineReader::next()
+{
+    std::size_t eol;
+    while ((eol = buffer_.find('\n', pos_)) == std::string::npos)
+    {
+        if (fill())
+            continue;
+        if (pos_ == buffer_.size())
+            return false;
+        eol = buffer_.size(); // last line without a new line
+        break;
+    }
+    line_.assign(buffer_, pos_, eol - pos_);
+    pos_ = std::min(eol + 1, buffer_.size());
+    if (hasTimestamp(line_))
+        key_.assign(line_, 0, 29);
+    return true;
+}
+
+struct Later
+{
+    explicit Later(const std::vector<LineReader*>& readers) : readers_(readers) {}
+    bool operator()(std::size_t a, std::size_t b) const
+    {
+        int cmp = readers_[a]->key_.compare(readers_[b]->key_);
+        return cmp > 0 || (cmp == 0 && a > b);
+    }
+    const std::vector<LineReader*>& readers_;
+};
+
+int main(int argc, char* argv[])
+{
+    STD_FUNCTION_BEGIN;
+    ENFORCE(argc > 1)("Usage: ")(argv[0])(" segment...");
+    std::vector<LineReader*> readers;
+    for (int i = 1; i != argc; ++i)
+        readers.push_back(new LineReader(argv[i]));
+    std::priority_queue<std::size_t, std::vector<std::size_t>, Later> heap((Later(readers)));
+    for (std::size_t i = 0; i != readers.size(); ++i)
+        if (readers[i]->next())
+            heap.push(i);
+    while (!heap.empty())
+    {
+        std::size_t i = heap.top();
+        heap.pop();
+        LineReader& reader = *readers[i];
+        fwrite(reader.line_.data(), 1, reader.line_.size(), stdout);
+        fputc('\n', stdout);
+        while (reader.next())
+        {
+            if (hasTimestamp(reader.line_))
+            {
+                heap.push(i);
+                break;
+            }
+            fwrite(reader.line_.data(), 1, reader.line_.size(), stdout);
+            fputc('\n', stdout);
+        }
+    }
+    for (std::size_t i = 0; i != readers.size(); ++i)
+        delete readers[i];
+    return 0;
+    STD_FUNCTION_END;
+    return -1;
+}
@@ -0,0 +1,156 @@
+/*******************************************************************************
+ *                           Author: Petru Marginean                           *
+ *                          petru.marginean@gmail.com                          *
+ ******************************************************************************/
+
+// alogquery log from to : writes the records of an indexed ALog output (see
+// IndexSink) logged in [from, to), both in milliseconds since the epoch. The
+// log and its .idx sidecar are mmap()-ed, the index is binary searched and
+// only the part of the log between the two index entries is scanned; for a
+// compressed log only the frames in that part get decompressed.
+
+#include "alogsink.h"
+#include "scopeexit.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct MappedFile
+{
+    explicit MappedFile(const std::string& fname);
+    ~MappedFile();
+    const char* pData_;
+    std::size_t size_;
+private:
+    MappedFile(const MappedFile&);
+};
+
+inline MappedFile::MappedFile(const std::string& fname) : pData_(0), size_(0)
+{
+    int fd = open(fname.c_str(), O_RDONLY);
+    ENFORCE(fd >= 0)("Cannot open '")(fname)("'");
+    SCOPE_EXIT(close(fd));
+    struct stat st;
+    ENFORCE(fstat(fd, &st) == 0);
+    size_ = st.st_size;
+    if (!size_)
+        return;
+    void* p = mmap(0, size_, PROT_READ, MAP_SHARED, fd, 0);
+    ENFORCE(p != MAP_FAILED)("Cannot mmap '")(fname)("'");
+    pData_ = (const char*)p;
+}
+
+inline MappedFile::~MappedFile()
+{
+    if (pData_)
+        munmap((void*)pData_, size_);
+}
+
+// the same "YYYY-MM-DD HH:MM:SS.nnnnnnnnn" prefix ALog::format() writes, so lines compare as text
+inline std::string timestamp(int64_t msec)
+{
+    time_t sec = msec / 1000;
+    tm now;
+    char buffer[100] = {0};
+    ENFORCE(strftime(buffer, sizeof(buffer), "%F %T", localtime_r(&sec, &now)));
+    char result[100] = {0};
+    snprintf(result, sizeof(result), "%s.%03d000000", buffer, int(msec % 1000));
+    return result;
+}
+
+// first entry logged after nsec
+inline const ALogIndexEntry* upper(const ALogIndexEntry* pBegin, const ALogIndexEntry* pEnd, int64_t nsec)
+{
+    std::size_t n = pEnd - pBegin;
+    while (n)
+    {
+        std::size_t half = n / 2;
+        if (pBegin[half].nsec <= nsec)
+        {
+            pBegin += half + 1;
+            n -= half + 1;
+        }
+        else
+            n = half;
+    }
+    return pBegin;
+}
+
+// decompresses the frames starting at offsets in [begin, end], the frame at
+// end included since a record starting before it can continue in it
+inline std::string decompress(const MappedFile& log, std::size_t begin, std::size_t end)
+{
+    std::string text;
+    for (std::size_t offset = begin; offset <= end && offset + sizeof(LzFrame) <= log.size_;)
+    {
+        LzFrame frame;
+        memcpy(&frame, log.pData_ + offset, sizeof(frame));
+        if (!frame.magic) // not written yet
+            break;
+        ENFORCE(frame.magic == LzFrame::MAGIC)("Bad frame at offset ")(offset);
+        const char* pPacked = log.pData_ + offset + sizeof(frame);
+        if (offset + sizeof(frame) + frame.stored > log.size_) // still being written
+            break;
+        std::size_t size = text.size();
+        text.resize(size + frame.raw);
+        if (frame.flags & LzFrame::COMPRESSED)
+            ENFORCE(lzDecompress(pPacked, frame.stored, &text[size], frame.raw) == frame.raw)
+                ("Bad frame at offset ")(offset);
+        else
+            memcpy(&text[size], pPacked, frame.raw);
+        offset += sizeof(frame) + frame.stored;
+    }
+    return text;
+}
+
+int main(int argc, char* argv[])
+{
+    STD_FUNCTION_BEGIN;
+    ENFORCE(argc == 4)("Usage: ")(argv[0])(" log from_msec to_msec");
+    int64_t from = strtoll(argv[2], 0, 10), to = strtoll(argv[3], 0, 10);
+    MappedFile log(argv[1]);
+    MappedFile index(std::string(argv[1]) + ".idx");
+    ENFORCE(index.size_ >= sizeof(uint64_t) && *(const uint64_t*)index.pData_ == ALogIndexEntry::MAGIC)
+        ("'")(argv[1])(".idx' is not an ALog index");
+    const ALogIndexEntry* pBegin = (const ALogIndexEntry*)(index.pData_ + sizeof(uint64_t));
+    const ALogIndexEntry* pEnd = pBegin + (index.size_ - sizeof(uint64_t)) / sizeof(ALogIndexEntry);
+    // the index entry before from is at or before the first record to output,
+    // the first entry after to is past the last one
+    const ALogIndexEntry* pFirst = upper(pBegin, pEnd, from * 1000000);
+    const ALogIndexEntry* pLast = upper(pFirst, pEnd, to * 1000000);
+    std::size_t begin = pFirst == pBegin ? 0 : std::min<std::size_t>(pFirst[-1].offset, log.size_);
+    std::size_t end = pLast == pEnd ? log.size_ : std::min<std::size_t>(pLast->offset, log.size_);
+    const char *pStart = log.pData_ + begin, *pStop = log.pData_ + end;
+    std::string text;
+    if (log.size_ >= sizeof(uint32_t) && *(const uint32_t*)log.pData_ == LzFrame::MAGIC)
+    {
+        // the offsets are the ones of frames, the first line can be the end of a record
+        text = decompress(log, begin, end);
+        pStart = text.data();
+        pStop = text.data() + text.size();
+    }
+    std::string fromKey = timestamp(from), toKey = timestamp(to);
+    bool inside = false;
+    for (const char* p = pStart; p < pStop;)
+    {
+        const char* pEol = (const char*)memchr(p, '\n', pStop - p);
+        const char* pNext = pEol ? pEol + 1 : pStop;
+        std::size_t len = pNext - p;
+        if (len >= 29 && p[4] == '-' && p[10] == ' ' && p[19] == '.')
+        {
+            if (fromKey.compare(0, 29, p, 29) > 0)
+                inside = false;
+            else if (toKey.compare(0, 29, p, 29) <= 0)
+                break;
+            else
+                inside = true;
+        }
+        if (inside) // lines without a timestamp go with the record before them
+            fwrite(p, 1, len, stdout);
+        p = pNext;
+    }
+    return 0;
+    STD_FUNCTION_END;
+    return -1;
+}
@@ -1,3 +1,6 @@
 #!/bin/bash
 g++ main.cpp -I ~/cxxutil/include -Wall -std=gnu++11 -O3 -g -pthread -o test.exe
 #g++ main.cpp -I /home/petrum/cxxutil/include -Wall -std=gnu++11 -g -pthread -o test.exe
+g++ alogcat.cpp -I ~/cxxutil/include -Wall -std=gnu++11 -O3 -g -pthread -o alogcat
+g++ alogmerge.cpp -I ~/cxxutil/include -Wall -std=gnu++11 -O3 -g -pthread -o alogmerge
+g++ alogquery.cpp -I ~/cxxutil/include -Wall -std=gnu++11 -O3 -g -pthread -o alogquery
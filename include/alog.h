@@ -15,19 +15,32 @@ Potential issues:
 
 #include <unistd.h>
 #include <atomic>
+#include <mutex>
+#include <type_traits>
+#include <stdint.h>
 #include <thread>
 #include <sys/time.h>
 #include <fstream>
 #include <string.h>
 #include <stdlib.h>
 #include "filelog.h"
+#include "alogsink.h"
 #include <time.h>
 #include <sys/mman.h>
 #include <stdio.h>
+#include <signal.h>
+#include <errno.h>
+#include <vector>
+
+template <typename T, std::size_t N>
+    constexpr std::size_t countof(T const (&)[N]) noexcept
+{
+    return N;
+}
 
 struct CircularQueue
 {
-    CircularQueue(bool mmap, std::size_t max_row, std::size_t max_col);
+    CircularQueue(bool mmap, std::size_t max_row, std::size_t max_col, const std::string& name = "alog");
     ~CircularQueue();
     std::size_t next(std::size_t) const;
 public: // producer
@@ -37,6 +50,13 @@ public: //consumer
     char* getNextReadBuffer();
     void readComplete();
     bool empty() const;
+public: // flight recorder: the producer owns both ends, others only peek
+    void dropOldest();
+    std::size_t prev(std::size_t) const;
+    std::size_t writePosition() const;
+    const char* at(std::size_t) const;
+    std::size_t rows() const;
+    std::size_t cols() const;
 private:
     bool usemmap;
     std::atomic<std::size_t> max_row_, max_col_, head_, tail_, len_;
@@ -61,6 +81,36 @@ inline std::size_t CircularQueue::next(std::size_t i) const
     return res;
 }
 
+inline std::size_t CircularQueue::prev(std::size_t i) const
+{
+    return (i == 0 ? len_.load() : i) - max_col_;
+}
+
+inline void CircularQueue::dropOldest()
+{
+    head_ = next(head_);
+}
+
+inline std::size_t CircularQueue::writePosition() const
+{
+    return tail_;
+}
+
+inline const char* CircularQueue::at(std::size_t i) const
+{
+    return &pData[i];
+}
+
+inline std::size_t CircularQueue::rows() const
+{
+    return max_row_;
+}
+
+inline std::size_t CircularQueue::cols() const
+{
+    return max_col_;
+}
+
 inline bool CircularQueue::empty() const
 {
     bool isEmpty = next(head_) == tail_;
@@ -68,13 +118,13 @@ inline bool CircularQueue::empty() const
     return isEmpty;
 }
 
-inline CircularQueue::CircularQueue(bool m, std::size_t max_row, std::size_t max_col) : usemmap(m), 
+inline CircularQueue::CircularQueue(bool m, std::size_t max_row, std::size_t max_col, const std::string& name) : usemmap(m), 
                      max_row_(max_row), max_col_(max_col), head_(0), tail_(max_col), len_(max_row * max_col), tail2_(next(tail_))
 {
     if (usemmap)
     {
         std::ostringstream o;
-        o << getenv("HOME") << "/log/alog-" << getpid() << ".log";
+        o << getenv("HOME") << "/log/" << name << "-" << getpid() << ".log";
         //o << "/tmp/alog-" << getpid() << ".log";
         fname = o.str();
         FILE_LOG(logINFO) << "Use mmap() with the '" << fname << "' file";
@@ -157,6 +207,240 @@ inline char* CircularQueue::getNextReadBuffer()
     return &pData[head_];
 }
 
+// alogOVERWRITE makes a flight recorder: the oldest records get overwritten, the
+// consumer ignores the channel and its records are output only by ALog::dump()
+enum ALogOverflow {alogDROP, alogBLOCK, alogOVERWRITE};
+
+// A named ring with its own output; the reference returned by ALog::addChannel()
+// is stable for the lifetime of the ALog, so producers should keep it around
+// instead of looking the channel up for every message. Each channel expects a
+// single producer thread, except for the shards (see ALog::setShards()) which
+// serialize their producers with a spin lock.
+struct ALogChannel
+{
+    ALogChannel(const std::string& name, std::size_t max_row, std::size_t max_col, 
+                ALogOverflow overflow, ALogSink* pSink, bool mmap);
+    ~ALogChannel();
+    const std::string& name() const;
+private:
+    ALogChannel(const ALogChannel&);
+    char* getNextWriteBuffer();
+    void writeComplete();
+    void lock();
+    void unlock();
+    std::size_t drain(std::size_t max);
+    void output(std::ostringstream& o);
+    void flush();
+    void flush(int64_t now, int64_t interval);
+    std::size_t copyLast(std::size_t max);
+    void dump(const std::string& reason, std::size_t max);
+    void dumpRaw(const char* reason, std::size_t max);
+private:
+    std::string name_;
+    ALogOverflow overflow_;
+    CircularQueue queue_;
+    ALogSink* pSink_;
+    std::atomic<bool> closed_;
+    bool shared_; // several producers, held by busy_ from getNextWriteBuffer() to writeComplete()
+    std::atomic<bool> busy_;
+    std::size_t written, lost, read;
+    __syscall_slong_t last_;
+    bool dirty_;
+    int64_t flushed_; // CLOCK_MONOTONIC nsec of the last flush
+    std::vector<std::atomic<std::size_t> > seq_; // per row, odd while the row is being written
+    std::size_t row_;
+    std::vector<char> records_; // the copy a dump formats, allocated upfront for the signal handler
+    friend struct ALog;
+    friend struct ALogMsg;
+    friend std::ostream& operator <<(std::ostream& o, const ALogChannel& c);
+};
+
+inline std::ostream& operator <<(std::ostream& o, const ALogChannel& c)
+{
+    return o << "channel = '" << c.name_ << "', written = " << c.written << ", lost = " << c.lost << 
+        ", read = " << c.read << ", logged = " << c.written + c.lost;
+}
+
+typedef void (*ALogFormatter)(std::ostream& o, const void* pData, void (*pUser)());
+
+struct ALogTypeInfo
+{
+    const char* name;
+    std::size_t size;
+    ALogFormatter formatter;
+    void (*pUser)();
+};
+
+// the id ALog::addType() assigned to T, 0 when T is not registered
+template <typename T>
+struct ALogType
+{
+    static uint16_t id;
+};
+
+template <typename T>
+uint16_t ALogType<T>::id = 0;
+
+template <typename T>
+void ALogFormat(std::ostream& o, const void* pData, void (*)())
+{
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type t; // the record is not aligned
+    memcpy(&t, pData, sizeof(T));
+    o << *reinterpret_cast<const T*>(&t);
+}
+
+template <typename T>
+void ALogFormatWith(std::ostream& o, const void* pData, void (*pUser)())
+{
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type t;
+    memcpy(&t, pData, sizeof(T));
+    reinterpret_cast<void (*)(std::ostream&, const T&)>(pUser)(o, *reinterpret_cast<const T*>(&t));
+}
+
+inline int64_t monotonicNsec()
+{
+    timespec dt;
+    clock_gettime(CLOCK_MONOTONIC, &dt);
+    return int64_t(dt.tv_sec) * 1000000000 + dt.tv_nsec;
+}
+
+inline unsigned long long rdtsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((unsigned long long)lo) | (((unsigned long long)hi) << 32);
+#else
+    timespec dt;
+    clock_gettime(CLOCK_MONOTONIC, &dt);
+    return dt.tv_sec * 1000000000ULL + dt.tv_nsec;
+#endif
+}
+
+// measured once against CLOCK_MONOTONIC (10 msec); ALog::init() does the first call
+inline double tscTicksPerNsec()
+{
+    static const double ticks = []
+    {
+        timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        unsigned long long c0 = rdtsc();
+        usleep(10000);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        unsigned long long c1 = rdtsc();
+        double nsec = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+        return (c1 - c0) / nsec;
+    }();
+    return ticks;
+}
+
+// Async signal safe text for the dumps done from a signal handler: no
+// allocation, no locale and no stdio; what does not fit in the buffer is cut.
+struct ALogRawLine
+{
+    ALogRawLine(char* pBuffer, std::size_t size);
+    ALogRawLine& text(const char* p, std::size_t n);
+    ALogRawLine& text(const char* p);
+    ALogRawLine& number(unsigned long long u, unsigned width = 0, unsigned base = 10);
+    ALogRawLine& integer(long long i);
+    ALogRawLine& real(double d); // fixed point with up to 6 decimals
+    void write(int fd); // writes the line and a new line, then starts over
+private:
+    char *pBegin_, *p_, *pEnd_;
+};
+
+inline ALogRawLine::ALogRawLine(char* pBuffer, std::size_t size) : 
+    pBegin_(pBuffer), p_(pBuffer), pEnd_(pBuffer + size - 1) // room for the new line
+{
+}
+
+inline ALogRawLine& ALogRawLine::text(const char* p, std::size_t n)
+{
+    n = std::min(n, std::size_t(pEnd_ - p_));
+    memcpy(p_, p, n);
+    p_ += n;
+    return *this;
+}
+
+inline ALogRawLine& ALogRawLine::text(const char* p)
+{
+    return text(p, strlen(p));
+}
+
+inline ALogRawLine& ALogRawLine::number(unsigned long long u, unsigned width, unsigned base)
+{
+    char digits[64];
+    std::size_t n = 0;
+    do
+    {
+        digits[n++] = "0123456789abcdef"[u % base];
+        u /= base;
+    } while (u);
+    while (n < width && n < sizeof(digits))
+        digits[n++] = '0';
+    while (n && p_ != pEnd_)
+        *p_++ = digits[--n];
+    return *this;
+}
+
+inline ALogRawLine& ALogRawLine::integer(long long i)
+{
+    if (i < 0)
+        return text("-", 1).number(0ULL - (unsigned long long)i);
+    return number(i);
+}
+
+inline ALogRawLine& ALogRawLine::real(double d)
+{
+    if (d != d)
+        return text("nan");
+    if (d < 0)
+    {
+        text("-", 1);
+        d = -d;
+    }
+    if (d >= 1e19) // the integer part does not fit
+    {
+        if (d - d != 0)
+            return text("inf");
+        int e = 0;
+        for (; d >= 10; ++e)
+            d /= 10;
+        return real(d).text("e+").number(e);
+    }
+    unsigned long long whole = d;
+    unsigned long long fraction = (d - whole) * 1000000 + 0.5;
+    if (fraction == 1000000)
+    {
+        ++whole;
+        fraction = 0;
+    }
+    number(whole);
+    if (!fraction)
+        return *this;
+    unsigned width = 6;
+    for (; fraction % 10 == 0; --width)
+        fraction /= 10;
+    return text(".", 1).number(fraction, width);
+}
+
+inline void ALogRawLine::write(int fd)
+{
+    *p_++ = '\n';
+    for (const char* p = pBegin_; p != p_;)
+    {
+        ssize_t n = ::write(fd, p, p_ - p);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        p += n;
+    }
+    p_ = pBegin_;
+}
+
+struct ALogSite;
+
 struct ALog
 {
     void init(std::size_t max_row, std::size_t max_col, bool mmap = false);
@@ -167,14 +451,66 @@ public:
     static ALog& get();
     static ALog* const pALog;
     void stop();
+    void setOutput(ALogSink* pSink); // takes ownership, call before init()
+    void setFlushInterval(std::size_t msec); // how long an idle sink may hold records, 100 msec by default
+    static const timespec& format(const char* pData, std::ostream& o);
+    static void formatRaw(const char* pData, std::size_t size, ALogRawLine& line); // async signal safe
+public: // channels
+    ALogChannel& addChannel(const std::string& name, std::size_t max_row, std::size_t max_col, 
+                            ALogOverflow overflow = alogDROP, ALogSink* pSink = 0, bool mmap = false);
+    ALogChannel& channel(const std::string& name);
+    ALogChannel& defaultChannel();
+public: // consumer pool and per producer thread shards
+    void setConsumers(std::size_t n); // call before init()
+    void setShards(const std::string& prefix, std::size_t count, std::size_t max_row, std::size_t max_col, 
+                   ALogOverflow overflow = alogDROP, ALogSinkFactory factory = &makeFileSink);
+    ALogChannel& shard();
+public: // user defined types, to be registered before they get logged
+    template <typename T>
+    void addType(const char* name); // formats with operator <<(std::ostream&, const T&)
+    template <typename T>
+    void addType(const char* name, void (*formatter)(std::ostream&, const T&));
+private:
+    template <typename T>
+    void addType(const char* name, ALogFormatter formatter, void (*pUser)());
+public: // rate limited call sites
+    void addSite(ALogSite* pSite);
+    void setSiteReport(std::size_t sec); // 0 disables the periodic report
+private:
+    void reportSites();
+public: // flight recorders
+    enum {alogTRIGGER_ENFORCE = 1, alogTRIGGER_ERROR = 2, alogTRIGGER_SIGNAL = 4, alogTRIGGER_ALL = 7};
+    void setTriggers(int triggers = alogTRIGGER_ALL, std::size_t records = std::size_t(-1)); // 0 removes them
+    void dump(const std::string& reason, std::size_t records = std::size_t(-1));
 private:
+    static std::size_t recordSize(std::size_t typeSize);
+    static void onThrow(const std::string& reason);
+    static void onError(const std::string& text);
+    static std::string& lastThrow();
+    static void onSignal(int sig);
     ALog(const ALog&);
-    void consume();
+    void consume(std::size_t index);
 private:
-    CircularQueue* pQueue_;
-    std::thread consumer_;
+    enum { MAX_CHANNELS = 64, BATCH = 64, MAX_TYPES = 256 };
+    ALogChannel* channels_[MAX_CHANNELS];
+    std::atomic<std::size_t> count_;
+    ALogTypeInfo types_[MAX_TYPES];
+    std::size_t typeCount_, maxTypeSize_;
+    std::atomic<ALogSite*> sites_;
+    std::size_t siteReport_;
+    int64_t flushInterval_;
+    int triggers_;
+    std::size_t triggerRecords_;
+    long utcOffset_; // sec, taken by setTriggers() for formatRaw()
+    std::atomic<bool> dumping_;
+    std::mutex mutex_;
+    ALogChannel* pDefault_;
+    ALogSink* pSink_;
+    std::vector<std::thread> consumers_;
+    std::size_t consumerCount_;
+    std::vector<ALogChannel*> shards_;
+    std::atomic<std::size_t> shardThreads_;
     std::atomic<bool> stopping_;
-    std::size_t written, lost, read;
     friend struct ALogMsg;
 };
 
@@ -196,7 +532,199 @@ inline char* doWrite(const char* pText, char* pData)
     return pData + c;
 }
 
-inline ALog::ALog() : pQueue_(0), stopping_(false), written(0), lost(0), read(0)
+inline ALogChannel::ALogChannel(const std::string& name, std::size_t max_row, std::size_t max_col, 
+                                ALogOverflow overflow, ALogSink* pSink, bool mmap) : 
+    name_(name), overflow_(overflow), queue_(mmap, max_row, max_col, name == "default" ? "alog" : "alog-" + name),
+    pSink_(pSink), closed_(false), shared_(false), busy_(false), written(0), lost(0), read(0), last_(0), dirty_(false), flushed_(0), 
+    seq_(overflow == alogOVERWRITE ? max_row : 0), row_(0), records_(overflow == alogOVERWRITE ? max_row * max_col : 0)
+{
+    FILE_LOG(logINFO) << "ALogChannel::ALogChannel('" << name_ << "', " << max_row << ", " << max_col << 
+        ", overflow = " << overflow_ << ")";
+}
+
+inline ALogChannel::~ALogChannel()
+{
+    FILE_LOG(logINFO) << "ALogChannel::~ALogChannel(" << *this << ")";
+    delete pSink_;
+}
+
+inline const std::string& ALogChannel::name() const
+{
+    return name_;
+}
+
+inline void ALogChannel::lock()
+{
+    while (busy_.exchange(true, std::memory_order_acquire))
+        std::this_thread::yield();
+}
+
+inline void ALogChannel::unlock()
+{
+    busy_.store(false, std::memory_order_release);
+}
+
+inline char* ALogChannel::getNextWriteBuffer()
+{
+    if (shared_)
+        lock();
+    char* pData = queue_.getNextWriteBuffer();
+    if (overflow_ == alogBLOCK)
+    {
+        while (!pData && !closed_)
+        {
+            std::this_thread::yield();
+            pData = queue_.getNextWriteBuffer();
+        }
+    }
+    else if (overflow_ == alogOVERWRITE)
+    {
+        if (!pData)
+        {
+            queue_.dropOldest();
+            pData = queue_.getNextWriteBuffer();
+        }
+        row_ = queue_.writePosition() / queue_.cols();
+        seq_[row_].store(2 * written + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+    if (!pData)
+    {
+        ++lost;
+        if (shared_)
+            unlock();
+    }
+    return pData;
+}
+
+inline void ALogChannel::writeComplete()
+{
+    if (overflow_ == alogOVERWRITE)
+        seq_[row_].store(2 * written + 2, std::memory_order_release);
+    queue_.writeComplete();
+    ++written;
+    if (shared_)
+        unlock();
+}
+
+// consumer: formats and outputs at most max records, returns how many were read
+inline std::size_t ALogChannel::drain(std::size_t max)
+{
+    std::size_t n = 0;
+    if (overflow_ == alogOVERWRITE)
+        return n;
+    for (char* pData; n != max && (pData = queue_.getNextReadBuffer()); ++n)
+    {
+        std::ostringstream o;
+        const timespec& dt = ALog::format(pData, o);
+        o << " (" << dt.tv_nsec - last_ << " nsec, read = " << read << ")";
+        last_ = dt.tv_nsec;
+        if (pSink_)
+            pSink_->mark(dt);
+        output(o);
+        ++read;
+    }
+    return n;
+}
+
+inline void ALogChannel::output(std::ostringstream& o)
+{
+    if (pSink_)
+    {
+        o << '\n';
+        const std::string& line = o.str();
+        pSink_->write(line.data(), line.size());
+        dirty_ = true;
+    }
+    else
+    {
+        FILE_LOG(logINFO) << o.str();
+    }
+}
+
+// copies the last max records of a flight recorder in records_, the newest
+// first, and returns how many; called from any thread while the producer keeps
+// writing, the rows overwritten during the copy are skipped
+inline std::size_t ALogChannel::copyLast(std::size_t max)
+{
+    std::size_t cols = queue_.cols();
+    std::size_t n = std::min(std::min(max, std::size_t(written)), queue_.rows() - 2);
+    std::size_t count = 0;
+    for (std::size_t i = queue_.writePosition(), k = 0; k != n; ++k)
+    {
+        i = queue_.prev(i);
+        std::atomic<std::size_t>& seq = seq_[i / cols];
+        std::size_t before = seq.load(std::memory_order_acquire);
+        if (!before || before % 2)
+            continue;
+        memcpy(&records_[count * cols], queue_.at(i), cols);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seq.load(std::memory_order_relaxed) == before)
+            ++count;
+    }
+    return count;
+}
+
+inline void ALogChannel::dump(const std::string& reason, std::size_t max)
+{
+    std::size_t count = copyLast(max);
+    std::ostringstream o;
+    o << "Flight recorder '" << name_ << "': last " << count << " records (" << reason << ")";
+    output(o);
+    for (std::size_t i = count; i--;)
+    {
+        std::ostringstream o;
+        ALog::format(&records_[i * queue_.cols()], o);
+        output(o);
+    }
+    std::ostringstream end;
+    end << "Flight recorder '" << name_ << "': end";
+    output(end);
+    flush();
+}
+
+// the dump done from a signal handler, which the crash could have interrupted
+// inside malloc() or stdio: no allocation, write(2) straight to the sink when
+// it allows it (FileSink, see ALogSink::fd()) or to stderr
+inline void ALogChannel::dumpRaw(const char* reason, std::size_t max)
+{
+    static char buffer[4096]; // the dumps are serialized by ALog::dumping_
+    int fd = pSink_ && pSink_->fd() >= 0 ? pSink_->fd() : STDERR_FILENO;
+    ALogRawLine line(buffer, sizeof(buffer));
+    std::size_t count = copyLast(max), cols = queue_.cols();
+    line.text("Flight recorder '").text(name_.data(), name_.size()).text("': last ").number(count).
+        text(" records (").text(reason).text(")").write(fd);
+    for (std::size_t i = count; i--;)
+    {
+        ALog::formatRaw(&records_[i * cols], cols, line);
+        line.write(fd);
+    }
+    line.text("Flight recorder '").text(name_.data(), name_.size()).text("': end").write(fd);
+}
+
+inline void ALogChannel::flush()
+{
+    if (!dirty_)
+        return;
+    pSink_->flush();
+    dirty_ = false;
+}
+
+// flushes at most once per interval, so a sink like CompressingSink gets
+// large blocks even when the consumer finds the queue empty after every record
+inline void ALogChannel::flush(int64_t now, int64_t interval)
+{
+    // like drain(), leaves a flight recorder's sink to dump(), the only thread writing to it
+    if (overflow_ == alogOVERWRITE || !dirty_ || now - flushed_ < interval)
+        return;
+    flush();
+    flushed_ = now;
+}
+
+inline ALog::ALog() : count_(0), typeCount_(1), maxTypeSize_(0), sites_(0), siteReport_(10), flushInterval_(100000000), 
+                      triggers_(0), triggerRecords_(std::size_t(-1)), utcOffset_(0), dumping_(false), pDefault_(0), pSink_(0), 
+                      consumerCount_(1), shardThreads_(0), 
+                      stopping_(false)
 {
     FILE_LOG(logINFO) << "ALog::ALog()";
 }
@@ -204,84 +732,391 @@ inline ALog::ALog() : pQueue_(0), stopping_(false), written(0), lost(0), read(0)
 inline void ALog::init(std::size_t max_row, std::size_t max_col, bool mmap)
 {
     FILE_LOG(logINFO) << "ALog::init(" << max_row << ", " << max_col << ")";
-    pQueue_ = new CircularQueue(mmap, max_row, max_col);
-    consumer_ = std::thread(&ALog::consume, this);
+    FILE_LOG(logINFO) << "TSC ticks per nsec = " << tscTicksPerNsec(); // calibrate outside the hot path
+    pDefault_ = &addChannel("default", max_row, max_col, alogDROP, pSink_, mmap);
+    pSink_ = 0;
+    for (std::size_t i = 0; i != consumerCount_; ++i)
+        consumers_.push_back(std::thread(&ALog::consume, this, i));
 }
 
 inline ALog::~ALog()
 {
     FILE_LOG(logINFO) << "Log::~ALog() enter";
     stop();
-    delete pQueue_;
-    FILE_LOG(logINFO) << "Log::~ALog() exit: written = " << written << ", lost = " << lost << 
-        ", read = " << read << ", logged = " << written + lost;
+    // a failure while the channels get deleted (e.g. the last write to a full
+    // disk) must not dump channels already deleted
+    if (triggers_)
+        setTriggers(0);
+    std::size_t n = count_;
+    count_ = 0;
+    for (std::size_t i = 0; i != n; ++i)
+        delete channels_[i];
+    delete pSink_;
+    FILE_LOG(logINFO) << "Log::~ALog() exit";
+}
+
+inline void ALog::setOutput(ALogSink* pSink)
+{
+    FILE_LOG(logINFO) << "ALog::setOutput(" << pSink << ")";
+    ENFORCE(consumers_.empty())("ALog::setOutput() must be called before ALog::init()");
+    delete pSink_;
+    pSink_ = pSink;
+}
+
+inline void ALog::setFlushInterval(std::size_t msec)
+{
+    FILE_LOG(logINFO) << "ALog::setFlushInterval(" << msec << ")";
+    flushInterval_ = int64_t(msec) * 1000000;
+}
+
+inline ALogChannel& ALog::addChannel(const std::string& name, std::size_t max_row, std::size_t max_col, 
+                                     ALogOverflow overflow, ALogSink* pSink, bool mmap)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::size_t n = count_;
+    for (std::size_t i = 0; i != n; ++i)
+        ENFORCE(channels_[i]->name() != name)("The '")(name)("' channel already exists");
+    ENFORCE(n != MAX_CHANNELS)("Too many channels, cannot add '")(name)("'");
+    ENFORCE(max_col >= recordSize(maxTypeSize_))("The '")(name)("' channel has ")(max_col)
+        (" byte slots, the registered types need ")(recordSize(maxTypeSize_));
+    channels_[n] = new ALogChannel(name, max_row, max_col, overflow, pSink, mmap);
+    count_ = n + 1; // publishes the channel to the consumer
+    return *channels_[n];
+}
+
+inline ALogChannel& ALog::channel(const std::string& name)
+{
+    ALogChannel* pChannel = 0;
+    for (std::size_t i = 0, n = count_; i != n && !pChannel; ++i)
+        if (channels_[i]->name() == name)
+            pChannel = channels_[i];
+    return *ENFORCE(pChannel)("Cannot find the '")(name)("' channel");
+}
+
+inline ALogChannel& ALog::defaultChannel()
+{
+    return *ENFORCE(pDefault_)("ALog::init() has not been called");
+}
+
+// consumer i drains the channels i, i + n, i + 2n... so each channel, and its
+// output, is still written by a single thread and keeps its order
+inline void ALog::setConsumers(std::size_t n)
+{
+    FILE_LOG(logINFO) << "ALog::setConsumers(" << n << ")";
+    ENFORCE(consumers_.empty())("ALog::setConsumers() must be called before ALog::init()");
+    ENFORCE(n > 0);
+    consumerCount_ = n;
+}
+
+// creates count channels, written to the <prefix>-<n>.log segments, that the
+// producer threads share: the n-th thread calling shard() writes to the shard
+// n % count. A channel is never created or retired afterwards, so any number
+// of threads can come and go; with more threads than shards, the threads of a
+// shard take turns through its spin lock. factory makes the sink of each
+// segment (a FileSink by default; a CompressingSink or an AsyncFileSink chain
+// otherwise) and alogmerge puts the segments back together. Call it once,
+// before the producers start.
+inline void ALog::setShards(const std::string& prefix, std::size_t count, std::size_t max_row, std::size_t max_col, 
+                            ALogOverflow overflow, ALogSinkFactory factory)
+{
+    FILE_LOG(logINFO) << "ALog::setShards('" << prefix << "', " << count << ", " << max_row << ", " << max_col << ")";
+    ENFORCE(shards_.empty())("ALog::setShards() has been called already");
+    ENFORCE(factory);
+    ENFORCE(count > 0 && count_ + count <= MAX_CHANNELS)("Cannot add ")(count)(" shards to ")(count_)
+        (" channels, the limit is ")(MAX_CHANNELS);
+    for (std::size_t i = 0; i != count; ++i)
+    {
+        std::ostringstream o;
+        o << i;
+        ALogChannel& channel = addChannel("shard-" + o.str(), max_row, max_col, overflow, 
+                                          factory(prefix + "-" + o.str() + ".log"));
+        channel.shared_ = true;
+        shards_.push_back(&channel);
+    }
+}
+
+inline ALogChannel& ALog::shard()
+{
+    static thread_local std::size_t index = std::size_t(-1);
+    ENFORCE(!shards_.empty())("ALog::setShards() has not been called");
+    if (index == std::size_t(-1))
+        index = shardThreads_++;
+    return *shards_[index % shards_.size()];
+}
+
+// the smallest slot holding a record with one value of the given size (0 for
+// an empty record): timestamp, 'x' tag, id, size, value and 'z' terminator
+inline std::size_t ALog::recordSize(std::size_t typeSize)
+{
+    return sizeof(timespec) + (typeSize ? 1 + 2 * sizeof(uint16_t) + typeSize : 0) + 1;
+}
+
+template <typename T>
+void ALog::addType(const char* name)
+{
+    addType<T>(name, &ALogFormat<T>, 0);
+}
+
+template <typename T>
+void ALog::addType(const char* name, void (*formatter)(std::ostream&, const T&))
+{
+    addType<T>(name, &ALogFormatWith<T>, reinterpret_cast<void (*)()>(ENFORCE(formatter)));
+}
+
+template <typename T>
+void ALog::addType(const char* name, ALogFormatter formatter, void (*pUser)())
+{
+    static_assert(std::is_trivially_copyable<T>::value, "ALog can only log trivially copyable types");
+    static_assert(sizeof(T) <= 0xffff, "ALog cannot log types larger than 64K");
+    FILE_LOG(logINFO) << "ALog::addType('" << name << "'), size = " << sizeof(T) << ", id = " << typeCount_;
+    std::lock_guard<std::mutex> lock(mutex_);
+    ENFORCE(!ALogType<T>::id)("The type '")(name)("' is already registered");
+    ENFORCE(typeCount_ != MAX_TYPES)("Too many types, cannot add '")(name)("'");
+    for (std::size_t i = 0, n = count_; i != n; ++i)
+        ENFORCE(channels_[i]->queue_.cols() >= recordSize(sizeof(T)))("The type '")(name)("' does not fit in the ")
+            (channels_[i]->queue_.cols())(" byte slots of the '")(channels_[i]->name())("' channel");
+    maxTypeSize_ = std::max(maxTypeSize_, sizeof(T));
+    ALogTypeInfo& info = types_[typeCount_];
+    info.name = name;
+    info.size = sizeof(T);
+    info.formatter = formatter;
+    info.pUser = pUser;
+    ALogType<T>::id = typeCount_++;
+}
+
+inline const timespec& ALog::format(const char* pData, std::ostream& o)
+{
+    const timespec& dt = *reinterpret_cast<const timespec*>(pData);
+    tm now;
+    char buffer[100] = {0};
+    ENFORCE(strftime(buffer, sizeof(buffer), "%F %T", localtime_r(&dt.tv_sec, &now)));
+    o << buffer;
+    ENFORCE(snprintf(buffer, sizeof(buffer), ".%09ld: ", dt.tv_nsec));
+    o << buffer;
+    pData += sizeof(timespec);
+    for (char ch; ch = pData++[0], ch != 'z';)
+    {
+        switch (ch)
+        {
+        case 'i':
+            o << *reinterpret_cast<const int*>(pData);
+            pData += sizeof(int);
+            break;
+        case 'u':
+            o << *reinterpret_cast<const unsigned int*>(pData);
+            pData += sizeof(unsigned int);
+            break;
+        case 'd':
+            o<< *reinterpret_cast<const double*>(pData);
+            pData += sizeof(double);
+            break;
+        case 'l':
+            o << *reinterpret_cast<const long unsigned int*>(pData);
+            pData += sizeof(long unsigned int);
+            break;
+        case 'I':
+            o << *reinterpret_cast<const long int*>(pData);
+            pData += sizeof(long int);
+            break;
+        case 'L':
+            o << *reinterpret_cast<const long long int*>(pData);
+            pData += sizeof(long long int);
+            break;
+        case 'U':
+            o << *reinterpret_cast<const long long unsigned int*>(pData);
+            pData += sizeof(long long unsigned int);
+            break;
+        case 'f':
+            o << *reinterpret_cast<const float*>(pData);
+            pData += sizeof(float);
+            break;
+        case 'B':
+            o << (*reinterpret_cast<const bool*>(pData) ? "true" : "false");
+            pData += sizeof(bool);
+            break;
+        case 'c':
+            o << *pData;
+            pData += sizeof(char);
+            break;
+        case 'p':
+            o << *reinterpret_cast<const void* const*>(pData);
+            pData += sizeof(const void*);
+            break;
+        case 's':
+            o << pData;
+            pData += strlen(pData) + 1;
+            break;                
+        case 'x':
+        {
+            uint16_t id, size;
+            memcpy(&id, pData, sizeof(id));
+            memcpy(&size, pData + sizeof(id), sizeof(size));
+            pData += sizeof(id) + sizeof(size);
+            const ALog& log = get();
+            if (id && id < log.typeCount_ && log.types_[id].size == size)
+                log.types_[id].formatter(o, pData, log.types_[id].pUser);
+            else
+                o << "<unregistered type, " << size << " bytes>";
+            pData += size;
+            break;
+        }
+        default:
+            ENFORCE(false)("Found unexpected type '")(ch)("'");
+        }
+    }
+    return dt;
 }
 
-inline void ALog::consume()
+// the same text as format(), except that the doubles are written in fixed point,
+// the user types only by name and the time with the UTC offset setTriggers()
+// took, since localtime_r() can take a lock
+inline void ALog::formatRaw(const char* pData, std::size_t size, ALogRawLine& line)
+{
+    const char* pEnd = pData + size;
+    const timespec& dt = *reinterpret_cast<const timespec*>(pData);
+    // days to civil date, see http://howardhinnant.github.io/date_algorithms.html
+    long long sec = dt.tv_sec + get().utcOffset_;
+    long long days = (sec >= 0 ? sec : sec - 86399) / 86400, rest = sec - days * 86400;
+    long long z = days + 719468, era = (z >= 0 ? z : z - 146096) / 146097;
+    long long doe = z - era * 146097, yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    long long doy = doe - (365 * yoe + yoe / 4 - yoe / 100), mp = (5 * doy + 2) / 153;
+    long long day = doy - (153 * mp + 2) / 5 + 1, month = mp < 10 ? mp + 3 : mp - 9;
+    long long year = yoe + era * 400 + (month <= 2);
+    line.number(year, 4).text("-", 1).number(month, 2).text("-", 1).number(day, 2).text(" ", 1).
+        number(rest / 3600, 2).text(":", 1).number(rest / 60 % 60, 2).text(":", 1).number(rest % 60, 2).
+        text(".", 1).number(dt.tv_nsec, 9).text(": ", 2);
+    pData += sizeof(timespec);
+    for (char ch; pData < pEnd && (ch = pData++[0], ch != 'z');)
+    {
+        switch (ch)
+        {
+        case 'i':
+            line.integer(*reinterpret_cast<const int*>(pData));
+            pData += sizeof(int);
+            break;
+        case 'u':
+            line.number(*reinterpret_cast<const unsigned int*>(pData));
+            pData += sizeof(unsigned int);
+            break;
+        case 'd':
+            line.real(*reinterpret_cast<const double*>(pData));
+            pData += sizeof(double);
+            break;
+        case 'l':
+            line.number(*reinterpret_cast<const long unsigned int*>(pData));
+            pData += sizeof(long unsigned int);
+            break;
+        case 'I':
+            line.integer(*reinterpret_cast<const long int*>(pData));
+            pData += sizeof(long int);
+            break;
+        case 'L':
+            line.integer(*reinterpret_cast<const long long int*>(pData));
+            pData += sizeof(long long int);
+            break;
+        case 'U':
+            line.number(*reinterpret_cast<const long long unsigned int*>(pData));
+            pData += sizeof(long long unsigned int);
+            break;
+        case 'f':
+            line.real(*reinterpret_cast<const float*>(pData));
+            pData += sizeof(float);
+            break;
+        case 'B':
+            line.text(*reinterpret_cast<const bool*>(pData) ? "true" : "false");
+            pData += sizeof(bool);
+            break;
+        case 'c':
+            line.text(pData, 1);
+            pData += sizeof(char);
+            break;
+        case 'p':
+            line.text("0x", 2).number((uintptr_t)*reinterpret_cast<const void* const*>(pData), 0, 16);
+            pData += sizeof(const void*);
+            break;
+        case 's':
+        {
+            std::size_t n = strnlen(pData, pEnd - pData);
+            line.text(pData, n);
+            pData += n + 1;
+            break;
+        }
+        case 'x':
+        {
+            uint16_t id, size;
+            memcpy(&id, pData, sizeof(id));
+            memcpy(&size, pData + sizeof(id), sizeof(size));
+            pData += sizeof(id) + sizeof(size) + size;
+            const ALog& log = get();
+            line.text("<", 1).text(id && id < log.typeCount_ ? log.types_[id].name : "unregistered type").
+                text(", ").number(size).text(" bytes>");
+            break;
+        }
+        default:
+            line.text("<corrupted record>");
+            return;
+        }
+    }
+}
+
+inline void ALog::consume(std::size_t index)
 {
     STD_FUNCTION_BEGIN;
-    FILE_LOG(logINFO) << "ALog::consume() started";
-    __syscall_slong_t last = 0;
-    for(std::size_t i = 0; !(stopping_ && pQueue_->empty()); ++i)
+    FILE_LOG(logINFO) << "ALog::consume(" << index << ") started";
+    std::size_t step = consumerCount_;
+    bool reporter = false; // the sites are reported by the consumer of the default channel
+    for (std::size_t c = index; c < count_; c += step)
+        reporter = reporter || channels_[c] == pDefault_;
+    time_t lastReport = time(0);
+    for(std::size_t i = 0; ; ++i)
     {
-        char* pData = pQueue_->getNextReadBuffer();
-        if (pData)
+        bool stopping = stopping_; // read before draining so nothing is left behind
+        std::size_t read = 0, n = count_;
+        int64_t now = 0;
+        for (std::size_t c = index; c < n; c += step)
         {
-            std::ostringstream o;
-            timespec& dt = *reinterpret_cast<timespec*>(pData);
-            tm *pNow = localtime(&dt.tv_sec);
-            char buffer[100] = {0};
-            ENFORCE(strftime(buffer, sizeof(buffer), "%F %T", pNow));
-            o << buffer;
-            ENFORCE(snprintf(buffer, sizeof(buffer), ".%09ld: ", dt.tv_nsec));
-            o << buffer;
-            pData += sizeof(timespec);
-            for (char ch; ch = pData++[0], ch != 'z';)
+            std::size_t drained = channels_[c]->drain(BATCH);
+            read += drained;
+            // caught up with this queue, push out what its sink has held for too long;
+            // a busy channel next to it does not hold it back
+            if (drained < BATCH)
             {
-                switch (ch)
-                {
-                case 'i':
-                    o << *reinterpret_cast<int*>(pData);
-                    pData += sizeof(int);
-                    break;
-                case 'u':
-                    o << *reinterpret_cast<unsigned int*>(pData);
-                    pData += sizeof(unsigned int);
-                    break;
-                case 'd':
-                    o<< *reinterpret_cast<double*>(pData);
-                    pData += sizeof(double);
-                    break;
-                case 'l':
-                    o << *reinterpret_cast<long unsigned int*>(pData);
-                    pData += sizeof(long unsigned int);
-                    break;
-                case 's':
-                    o << pData;
-                    pData += strlen(pData) + 1;
-                    break;                
-                default:
-                    ENFORCE(false)("Found unexpected type '")(ch)("'");
-                 }
+                if (!now)
+                    now = monotonicNsec();
+                channels_[c]->flush(now, stopping ? 0 : flushInterval_);
             }
-            o << " (" << dt.tv_nsec - last << " nsec, read = " << read << ")";
-            last = dt.tv_nsec;
-            FILE_LOG(logINFO) << o.str();
-            ++read;
         }
+        if (!read && stopping) // every queue is drained and its sink flushed
+            break;
         if (i % 1000 == 0)
+        {
             usleep(1);
+            time_t now = time(0);
+            if (reporter && siteReport_ && now - lastReport >= (time_t)siteReport_)
+            {
+                reportSites();
+                lastReport = now;
+            }
+        }
+    }
+    if (reporter)
+    {
+        reportSites();
+        pDefault_->flush();
     }
     STD_FUNCTION_END;
-    FILE_LOG(logINFO) << "ALog::consume() exited";
+    FILE_LOG(logINFO) << "ALog::consume(" << index << ") exited";
 }
 
 inline void ALog::stop()
 {
     FILE_LOG(logINFO) << "ALog::stop() enter";
     stopping_ = true;
-    if (consumer_.joinable())
-        consumer_.join();
+    for (std::size_t i = 0; i != consumers_.size(); ++i)
+        if (consumers_[i].joinable())
+            consumers_[i].join();
+    for (std::size_t i = 0, n = count_; i != n; ++i)
+        channels_[i]->closed_ = true;
     FILE_LOG(logINFO) << "ALog::stop() exit";
 }
 
@@ -290,45 +1125,226 @@ inline ALog& ALog::get()
     return *pALog;
 }
 
-template <typename T, std::size_t N>
-    constexpr std::size_t countof(T const (&)[N]) noexcept
+// Per call site state of the rate limited ALOG macros; a suppressed call only
+// updates the counters below and never touches the queue.
+struct ALogSite
 {
-    return N;
+    ALogSite(const char* file, int line);
+    bool everyN(std::size_t n);
+    bool firstN(std::size_t n);
+    bool everyInterval(unsigned long long nsec);
+private:
+    ALogSite(const ALogSite&);
+    bool suppress();
+private:
+    const char* file_;
+    int line_;
+    std::atomic<std::size_t> count_, suppressed_;
+    std::atomic<unsigned long long> last_;
+    std::size_t reported_; // consumer
+    ALogSite* pNext_;
+    friend struct ALog;
+};
+
+inline ALogSite::ALogSite(const char* file, int line) : file_(file), line_(line), count_(0), suppressed_(0),
+                                                       last_(0), reported_(0), pNext_(0)
+{
+    ALog::get().addSite(this);
+}
+
+inline bool ALogSite::suppress()
+{
+    suppressed_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+inline bool ALogSite::everyN(std::size_t n)
+{
+    std::size_t count = count_.fetch_add(1, std::memory_order_relaxed);
+    return (n && count % n == 0) || suppress();
+}
+
+inline bool ALogSite::firstN(std::size_t n)
+{
+    return (count_.load(std::memory_order_relaxed) < n && count_.fetch_add(1, std::memory_order_relaxed) < n) || 
+        suppress();
+}
+
+inline bool ALogSite::everyInterval(unsigned long long nsec)
+{
+    unsigned long long now = rdtsc();
+    unsigned long long last = last_.load(std::memory_order_relaxed);
+    if (last && now - last < nsec * tscTicksPerNsec())
+        return suppress();
+    return last_.compare_exchange_strong(last, now, std::memory_order_relaxed) || suppress();
+}
+
+// installs the hooks that dump the flight recorders on an ENFORCE failure, a
+// logERROR message or a fatal signal (see ALogChannel::dumpRaw()); an ENFORCE
+// under a DefaultRaiser::Quiet does not trigger, and a logERROR reporting the
+// exception just dumped (as STD_FUNCTION_END does) does not trigger again
+inline void ALog::setTriggers(int triggers, std::size_t records)
+{
+    FILE_LOG(logINFO) << "ALog::setTriggers(" << triggers << ", " << records << ")";
+    triggerRecords_ = records;
+    DefaultRaiser::OnThrow() = (triggers & alogTRIGGER_ENFORCE) ? &ALog::onThrow : 0;
+    FILELog::OnError() = (triggers & alogTRIGGER_ERROR) ? &ALog::onError : 0;
+    bool installed = triggers_ & alogTRIGGER_SIGNAL;
+    triggers_ = triggers;
+    if (!(triggers & alogTRIGGER_SIGNAL) && !installed)
+        return;
+    time_t now = time(0);
+    tm local;
+    utcOffset_ = localtime_r(&now, &local) ? local.tm_gmtoff : 0;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = (triggers & alogTRIGGER_SIGNAL) ? &ALog::onSignal : SIG_DFL; // SIG_DFL when removing them
+    sa.sa_flags = SA_RESETHAND;
+    sigemptyset(&sa.sa_mask);
+    const int signals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+    for (std::size_t i = 0; i != countof(signals); ++i)
+        ENFORCE(sigaction(signals[i], &sa, 0) == 0);
+}
+
+inline void ALog::dump(const std::string& reason, std::size_t records)
+{
+    if (dumping_.exchange(true)) // another thread is dumping, or the dump itself failed
+        return;
+    STD_FUNCTION_BEGIN;
+    for (std::size_t i = 0, n = count_; i != n; ++i)
+        if (channels_[i]->overflow_ == alogOVERWRITE)
+            channels_[i]->dump(reason, records);
+    STD_FUNCTION_END;
+    dumping_ = false;
+}
+
+inline std::string& ALog::lastThrow()
+{
+    static thread_local std::string reason;
+    return reason;
+}
+
+inline void ALog::onThrow(const std::string& reason)
+{
+    lastThrow() = reason;
+    get().dump(reason, get().triggerRecords_);
+}
+
+inline void ALog::onError(const std::string& text)
+{
+    std::string& last = lastThrow();
+    if (!last.empty() && text.find(last) != std::string::npos)
+    {
+        last.clear(); // dumped already when it was thrown
+        return;
+    }
+    get().dump(text, get().triggerRecords_);
+}
+
+inline void ALog::onSignal(int sig)
+{
+    alarm(5); // should the dump hang, SIGALRM ends the process
+    ALog& log = get();
+    const char* name = sig == SIGSEGV ? "SIGSEGV" : sig == SIGBUS ? "SIGBUS" : sig == SIGFPE ? "SIGFPE" : 
+        sig == SIGILL ? "SIGILL" : sig == SIGABRT ? "SIGABRT" : "signal"; // strsignal() is not async signal safe
+    if (!log.dumping_.exchange(true)) // not if the crash happened while dumping
+        for (std::size_t i = 0, n = log.count_; i != n; ++i)
+            if (log.channels_[i]->overflow_ == alogOVERWRITE)
+                log.channels_[i]->dumpRaw(name, log.triggerRecords_);
+    raise(sig); // SA_RESETHAND restored the default action
+}
+
+inline void ALog::addSite(ALogSite* pSite)
+{
+    pSite->pNext_ = sites_.load();
+    while (!sites_.compare_exchange_weak(pSite->pNext_, pSite));
+}
+
+inline void ALog::setSiteReport(std::size_t sec)
+{
+    siteReport_ = sec;
+}
+
+// consumer: reports, on the default channel, the calls suppressed since the last report
+inline void ALog::reportSites()
+{
+    for (ALogSite* pSite = sites_; pSite; pSite = pSite->pNext_)
+    {
+        std::size_t suppressed = pSite->suppressed_.load(std::memory_order_relaxed);
+        if (suppressed == pSite->reported_)
+            continue;
+        std::ostringstream o;
+        o << "ALOG " << pSite->file_ << ":" << pSite->line_ << " suppressed " << suppressed - pSite->reported_ << 
+            " messages (" << suppressed << " in total)";
+        pSite->reported_ = suppressed;
+        pDefault_->output(o);
+    }
 }
 
 struct ALogMsg
 {
     ALogMsg(); 
+    explicit ALogMsg(ALogChannel& channel);
     ~ALogMsg();
     ALogMsg& operator <<(int);
     ALogMsg& operator <<(unsigned int);
+    ALogMsg& operator <<(long int);
     ALogMsg& operator <<(long unsigned int i);
+    ALogMsg& operator <<(long long int);
+    ALogMsg& operator <<(long long unsigned int);
     ALogMsg& operator <<(double);
-    //ALogMsg& operator <<(const char*);
+    ALogMsg& operator <<(float);
+    ALogMsg& operator <<(bool);
+    ALogMsg& operator <<(char);
+    ALogMsg& operator <<(const void*);
 
-    template <typename T>                                                                                                                   
-    inline ALogMsg& operator <<(const T& t)
+    // a string longer than what is left in the slot gets truncated
+    template <std::size_t N>
+    inline ALogMsg& operator <<(const char (&t)[N])
     {
-        constexpr std::size_t N = countof(t);
-        if (!pData) return *this;
-        pData++[0] = 's';
-        //pData++[0] = '#';
-        memcpy(pData, t, N);
-        pData += N;
-        return *this;
+        return writeText(t, strnlen(t, N)); // a char buffer can be longer than its text
+    }
+
+    // char pointers, taken by reference so that the arrays above do not decay to them
+    template <typename T>
+    inline typename std::enable_if<std::is_same<T, const char*>::value || std::is_same<T, char*>::value, ALogMsg&>::type
+    operator <<(const T& pText)
+    {
+        return pText ? writeText(pText, strlen(pText)) : writeText("(null)", 6);
     }
     
+    // user defined types: only the bytes get copied here, the consumer formats them;
+    // the built in types have their own overloads so they never end up here
+    template <typename T>
+    inline typename std::enable_if<std::is_class<T>::value, ALogMsg&>::type operator <<(const T& t)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "ALog can only log trivially copyable types");
+        if (!fits(1 + 2 * sizeof(uint16_t) + sizeof(T))) return *this;
+        pData++[0] = 'x';
+        const uint16_t header[] = {ALogType<T>::id, sizeof(T)};
+        memcpy(pData, header, sizeof(header));
+        memcpy(pData + sizeof(header), &t, sizeof(T));
+        pData += sizeof(header) + sizeof(T);
+        return *this;
+    }
+
     template <typename T>
     inline ALogMsg& write(const T& t, char ch)
     {
-        if (!pData) return *this;
+        if (!fits(1 + sizeof(T))) return *this;
         pData++[0] = ch;
         *reinterpret_cast<T*>(pData) = t;
         pData += sizeof(T);
         return *this;        
     }
 private:
+    void begin();
+    bool fits(std::size_t n);
+    ALogMsg& writeText(const char* pText, std::size_t len); // len without the terminating 0
+private:
+    ALogChannel& channel_;
     char* pData;
+    char* pEnd; // the end of the slot, less the byte of the 'z' terminator
 };
 
 /*
@@ -343,16 +1359,6 @@ inline unsigned long long cpuid_rdtsc() {
     return ((unsigned long long)lo) | (((unsigned long long)hi) << 32);
 }
 
-inline unsigned long long rdtsc() {
-    unsigned int lo, hi;
-    asm volatile (
-     "rdtsc"
-     : "=a"(lo), "=d"(hi)
-     : "a"(0)
-     : "%ebx", "%ecx");
-    return ((unsigned long long)lo) | (((unsigned long long)hi) << 32);
-}
-
 inline unsigned long long rdtscp() {
     unsigned int lo, hi;
     asm volatile (
@@ -364,14 +1370,22 @@ inline unsigned long long rdtscp() {
 }
 */
 
-inline ALogMsg::ALogMsg()
+inline ALogMsg::ALogMsg() : channel_(*ALog::get().pDefault_)
+{
+    begin();
+}
+
+inline ALogMsg::ALogMsg(ALogChannel& channel) : channel_(channel)
+{
+    begin();
+}
+
+inline void ALogMsg::begin()
 {
-    pData = ALog::get().pQueue_->getNextWriteBuffer();
+    pData = channel_.getNextWriteBuffer();
     if (!pData)
-    {
-        ++ALog::get().lost;
         return;
-    }
+    pEnd = pData + channel_.queue_.cols() - 1;
     //*reinterpret_cast<unsigned long long*>(pData) = rdtscp();
     timespec dt;
     ENFORCE(clock_gettime(CLOCK_REALTIME, &dt) != -1);
@@ -379,12 +1393,36 @@ inline ALogMsg::ALogMsg()
     pData += sizeof(dt);
 }
   
+// a field that does not fit in the slot ends the record, the fields after it
+// are dropped too so that the record keeps its order
+inline bool ALogMsg::fits(std::size_t n)
+{
+    if (!pData)
+        return false;
+    if (std::size_t(pEnd - pData) >= n)
+        return true;
+    pEnd = pData;
+    return false;
+}
+
+inline ALogMsg& ALogMsg::writeText(const char* pText, std::size_t len)
+{
+    if (!fits(2)) return *this;
+    std::size_t n = std::min<std::size_t>(len, pEnd - pData - 2);
+    pData++[0] = 's';
+    memcpy(pData, pText, n);
+    pData[n] = 0;
+    pData += n + 1;
+    if (n != len)
+        pEnd = pData;
+    return *this;
+}
+
 inline ALogMsg::~ALogMsg()
 {
     if (!pData) return;
     pData[0] = 'z';
-    ALog::get().pQueue_->writeComplete();
-    ++ALog::get().written;
+    channel_.writeComplete();
 }
 
 inline ALogMsg& ALogMsg::operator <<(int i)
@@ -397,15 +1435,50 @@ inline ALogMsg& ALogMsg::operator <<(unsigned int u)
     return write(u, 'u');
 }
 
+inline ALogMsg& ALogMsg::operator <<(long int l)
+{
+    return write(l, 'I');
+}
+
 inline ALogMsg& ALogMsg::operator <<(long unsigned int l)
 {
     return write(l, 'l');
 }
 
+inline ALogMsg& ALogMsg::operator <<(long long int l)
+{
+    return write(l, 'L');
+}
+
+inline ALogMsg& ALogMsg::operator <<(long long unsigned int l)
+{
+    return write(l, 'U');
+}
+
 inline ALogMsg& ALogMsg::operator <<(double d)
 {
     return write(d, 'd');
 }
+
+inline ALogMsg& ALogMsg::operator <<(float f)
+{
+    return write(f, 'f');
+}
+
+inline ALogMsg& ALogMsg::operator <<(bool b)
+{
+    return write(b, 'B');
+}
+
+inline ALogMsg& ALogMsg::operator <<(char c)
+{
+    return write(c, 'c');
+}
+
+inline ALogMsg& ALogMsg::operator <<(const void* p)
+{
+    return write(p, 'p');
+}
 /*
 inline ALogMsg& ALogMsg::operator <<(const char* pText)
 {
@@ -419,5 +1492,14 @@ inline ALogMsg& ALogMsg::operator <<(const char* pText)
 }
 */
 #define ALOG ALogMsg()
+#define ALOG_TO(channel) ALogMsg(channel)
+#define ALOG_SHARD ALogMsg(ALog::get().shard())
+
+// each expansion owns a static ALogSite, created the first time the line runs
+#define ALOG_SITE (([]() -> ALogSite& { static ALogSite site(__FILE__, __LINE__); return site; })())
+// ALOG_EVERY_N(0) logs nothing, like ALOG_FIRST_N(0)
+#define ALOG_EVERY_N(n) if (!ALOG_SITE.everyN(n)) ; else ALOG
+#define ALOG_FIRST_N(n) if (!ALOG_SITE.firstN(n)) ; else ALOG
+#define ALOG_EVERY_INTERVAL(nsec) if (!ALOG_SITE.everyInterval(nsec)) ; else ALOG
 
 #endif //__ALOG_H__
@@ -0,0 +1,423 @@
+/*******************************************************************************
+ *                           Author: Petru Marginean                           *
+ *                          petru.marginean@gmail.com                          *
+ ******************************************************************************/
+
+/*
+  Output stages for the ALog consumer. The consumer formats a record and hands
+  the text to an ALogSink; sinks can be chained (e.g. compression -> file).
+
+  Compressed file layout: a sequence of independent frames, each one being
+    uint32 magic, uint32 raw size, uint32 stored size, uint32 flags, data
+  A frame is written with a single call to the next stage only once it is
+  complete, so a reader can follow a file that is still being written.
+
+  Time index (<log>.idx): uint64 magic followed by ALogIndexEntry records
+  mapping a record timestamp to the offset of that record in the log, one
+  every 'stride' bytes at most; alogquery binary searches it. Under a
+  CompressingSink the offsets are the ones of the frames, and the timestamp
+  the one of the first record starting in the frame.
+*/
+
+#ifndef __ALOGSINK_H__
+#define __ALOGSINK_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "filelog.h"
+#include "lzblock.h"
+
+struct ALogSink
+{
+    virtual ~ALogSink() {}
+    virtual void write(const char* pData, std::size_t len) = 0;
+    virtual void flush() {}
+    virtual void mark(const timespec&) {} // a record with this timestamp follows
+    // a descriptor the text can be appended to with write(2), bypassing any
+    // buffering, or -1; used by the flight recorder dumps from a signal handler
+    virtual int fd() const { return -1; }
+};
+
+struct FileSink : ALogSink
+{
+    explicit FileSink(const std::string& fname);
+    ~FileSink();
+    virtual void write(const char* pData, std::size_t len);
+    virtual void flush();
+    virtual int fd() const;
+private:
+    FileSink(const FileSink&);
+    std::string fname_;
+    FILE* fp_;
+};
+
+inline FileSink::FileSink(const std::string& fname) : fname_(fname)
+{
+    FILE_LOG(logINFO) << "FileSink::FileSink('" << fname_ << "')";
+    fp_ = ENFORCE(fopen(fname_.c_str(), "w"))("Cannot open '")(fname_)("'");
+}
+
+inline FileSink::~FileSink()
+{
+    int ret = fclose(fp_);
+    if (ret != 0)
+    {
+        FILE_LOG(logERROR) << "fclose('" << fname_ << "') has failed returning " << ret;
+    }
+}
+
+inline void FileSink::write(const char* pData, std::size_t len)
+{
+    ENFORCE(fwrite(pData, 1, len, fp_) == len)("Cannot write to '")(fname_)("'");
+}
+
+inline void FileSink::flush()
+{
+    fflush(fp_);
+}
+
+inline int FileSink::fd() const
+{
+    return fileno(fp_);
+}
+
+// makes the output stage of a file, e.g. of a shard segment (see ALog::setShards())
+typedef ALogSink* (*ALogSinkFactory)(const std::string& fname);
+
+inline ALogSink* makeFileSink(const std::string& fname)
+{
+    return new FileSink(fname);
+}
+
+struct ALogIndexEntry
+{
+    enum { MAGIC = 0x31584449474f4c41ULL /* "ALOGIDX1" */ };
+    int64_t nsec; // since the epoch
+    uint64_t offset;
+};
+
+// Keeps a sparse time index of the bytes it passes to the next stage, which
+// must write them unchanged (FileSink, AsyncFileSink). To index a compressed
+// log put it after the CompressingSink, which marks the frames instead of the
+// records: CompressingSink(IndexSink(FileSink)).
+struct IndexSink : ALogSink
+{
+    // takes ownership of pNext
+    IndexSink(ALogSink* pNext, const std::string& fname, std::size_t stride = 64 * 1024);
+    ~IndexSink();
+    virtual void write(const char* pData, std::size_t len);
+    virtual void flush();
+    virtual void mark(const timespec& dt);
+private:
+    IndexSink(const IndexSink&);
+    ALogSink* pNext_;
+    std::string fname_;
+    FILE* fp_;
+    std::size_t stride_;
+    uint64_t offset_, indexed_;
+    int64_t last_;
+};
+
+inline IndexSink::IndexSink(ALogSink* pNext, const std::string& fname, std::size_t stride) :
+    pNext_(ENFORCE(pNext)), fname_(fname), stride_(stride), offset_(0), indexed_(0), last_(0)
+{
+    FILE_LOG(logINFO) << "IndexSink::IndexSink('" << fname_ << "', " << stride_ << ")";
+    fp_ = ENFORCE(fopen(fname_.c_str(), "w"))("Cannot open '")(fname_)("'");
+    uint64_t magic = ALogIndexEntry::MAGIC;
+    ENFORCE(fwrite(&magic, sizeof(magic), 1, fp_) == 1)("Cannot write to '")(fname_)("'");
+}
+
+inline IndexSink::~IndexSink()
+{
+    delete pNext_;
+    int ret = fclose(fp_);
+    if (ret != 0)
+    {
+        FILE_LOG(logERROR) << "fclose('" << fname_ << "') has failed returning " << ret;
+    }
+}
+
+inline void IndexSink::write(const char* pData, std::size_t len)
+{
+    pNext_->write(pData, len);
+    offset_ += len;
+}
+
+inline void IndexSink::flush()
+{
+    pNext_->flush();
+    fflush(fp_);
+}
+
+inline void IndexSink::mark(const timespec& dt)
+{
+    if (offset_ && offset_ - indexed_ < stride_)
+        return;
+    // the clock can step back, keep the index sorted
+    last_ = std::max(last_, int64_t(dt.tv_sec) * 1000000000 + dt.tv_nsec);
+    ALogIndexEntry entry = {last_, offset_};
+    ENFORCE(fwrite(&entry, sizeof(entry), 1, fp_) == 1)("Cannot write to '")(fname_)("'");
+    indexed_ = offset_;
+}
+
+struct LzFrame
+{
+    enum { MAGIC = 0x315a4c41 /* "ALZ1" */, COMPRESSED = 1 };
+    uint32_t magic, raw, stored, flags;
+};
+
+struct CompressingSink : ALogSink
+{
+    // takes ownership of pNext; with a dedicated thread the consumer only copies
+    // the text, and waits once MAX_QUEUED blocks are waiting for the compressor
+    // (the rings then drop or block as their overflow policy says)
+    enum { MAX_QUEUED = 4 };
+    CompressingSink(ALogSink* pNext, bool thread = false, std::size_t blockSize = 64 * 1024);
+    ~CompressingSink();
+    virtual void write(const char* pData, std::size_t len);
+    virtual void flush();
+    virtual void mark(const timespec& dt); // forwarded once per frame, before the frame
+private:
+    struct Block
+    {
+        std::string text;
+        bool marked; // a record starts in the block, at the time below
+        timespec first;
+    };
+    CompressingSink(const CompressingSink&);
+    void push(); // queues or compresses pending_
+    void enqueue(std::unique_lock<std::mutex>& lock);
+    void compress(const Block& block);
+    void run();
+private:
+    ALogSink* pNext_;
+    std::size_t blockSize_;
+    Block pending_;
+    std::string packed_;
+    std::deque<Block> blocks_;
+    std::mutex mutex_;
+    std::condition_variable cv_, space_;
+    bool stopping_, flushing_;
+    std::thread compressor_;
+};
+
+inline CompressingSink::CompressingSink(ALogSink* pNext, bool thread, std::size_t blockSize) :
+    pNext_(ENFORCE(pNext)), blockSize_(blockSize), stopping_(false), flushing_(false)
+{
+    FILE_LOG(logINFO) << "CompressingSink::CompressingSink(" << blockSize_ << ", thread = " << thread << ")";
+    ENFORCE(blockSize_ > 0 && blockSize_ < (1u << 31));
+    pending_.text.reserve(blockSize_);
+    pending_.marked = false;
+    packed_.resize(sizeof(LzFrame) + lzCompressBound(blockSize_));
+    if (thread)
+        compressor_ = std::thread(&CompressingSink::run, this);
+}
+
+inline CompressingSink::~CompressingSink()
+{
+    flush();
+    if (compressor_.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_one();
+        compressor_.join();
+    }
+    delete pNext_;
+}
+
+inline void CompressingSink::write(const char* pData, std::size_t len)
+{
+    while (len)
+    {
+        std::size_t n = std::min(len, blockSize_ - pending_.text.size());
+        pending_.text.append(pData, n);
+        pData += n;
+        len -= n;
+        if (pending_.text.size() == blockSize_)
+            push();
+    }
+}
+
+inline void CompressingSink::flush()
+{
+    if (!compressor_.joinable())
+    {
+        if (!pending_.text.empty())
+            push();
+        pNext_->flush();
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!pending_.text.empty())
+            enqueue(lock);
+        flushing_ = true;
+    }
+    cv_.notify_one();
+    pending_.text.reserve(blockSize_);
+    pending_.marked = false;
+}
+
+inline void CompressingSink::mark(const timespec& dt)
+{
+    if (pending_.marked)
+        return;
+    pending_.marked = true;
+    pending_.first = dt;
+}
+
+inline void CompressingSink::push()
+{
+    if (!compressor_.joinable())
+        compress(pending_);
+    else
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            enqueue(lock);
+        }
+        cv_.notify_one();
+        pending_.text.reserve(blockSize_);
+    }
+    pending_.text.clear();
+    pending_.marked = false;
+}
+
+// consumer, with mutex_ held: moves pending_ to the queue once the compressor
+// has made room for it
+inline void CompressingSink::enqueue(std::unique_lock<std::mutex>& lock)
+{
+    space_.wait(lock, [this] { return blocks_.size() < MAX_QUEUED || stopping_; });
+    if (stopping_) // the compressor has failed, the text is lost
+    {
+        pending_.text.clear();
+        return;
+    }
+    blocks_.push_back(Block());
+    std::swap(blocks_.back(), pending_);
+}
+
+inline void CompressingSink::compress(const Block& block)
+{
+    if (block.marked)
+        pNext_->mark(block.first);
+    LzFrame& frame = *reinterpret_cast<LzFrame*>(&packed_[0]);
+    char* pOut = &packed_[sizeof(LzFrame)];
+    std::size_t n = lzCompress(block.text.data(), block.text.size(), pOut);
+    frame.magic = LzFrame::MAGIC;
+    frame.raw = block.text.size();
+    frame.flags = LzFrame::COMPRESSED;
+    if (n >= block.text.size()) // incompressible, store it as it is
+    {
+        memcpy(pOut, block.text.data(), block.text.size());
+        n = block.text.size();
+        frame.flags = 0;
+    }
+    frame.stored = n;
+    pNext_->write(packed_.data(), sizeof(LzFrame) + n);
+}
+
+inline void CompressingSink::run()
+{
+    STD_FUNCTION_BEGIN;
+    FILE_LOG(logINFO) << "CompressingSink::run() started";
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;)
+    {
+        cv_.wait(lock, [this] { return stopping_ || flushing_ || !blocks_.empty(); });
+        if (!blocks_.empty())
+        {
+            Block block;
+            std::swap(block, blocks_.front());
+            blocks_.pop_front();
+            space_.notify_one();
+            lock.unlock();
+            compress(block);
+            lock.lock();
+            continue;
+        }
+        if (flushing_)
+        {
+            flushing_ = false;
+            lock.unlock();
+            pNext_->flush();
+            lock.lock();
+            continue;
+        }
+        break;
+    }
+    STD_FUNCTION_END;
+    std::lock_guard<std::mutex> lock(mutex_); // after a failure too, so the consumer does not wait forever
+    stopping_ = true;
+    blocks_.clear();
+    space_.notify_one();
+    FILE_LOG(logINFO) << "CompressingSink::run() exited";
+}
+
+// Reads back the frames written by CompressingSink; next() returns false at the
+// end of the file or on a frame that is not completely written yet, leaving the
+// file positioned at its beginning so it can be retried later.
+struct CompressedReader
+{
+    explicit CompressedReader(FILE* fp);
+    bool next(std::string& block);
+    static bool isCompressed(FILE* fp);
+private:
+    FILE* fp_;
+    std::string packed_;
+};
+
+inline CompressedReader::CompressedReader(FILE* fp) : fp_(ENFORCE(fp))
+{
+}
+
+inline bool CompressedReader::isCompressed(FILE* fp)
+{
+    uint32_t magic = 0;
+    long pos = ftell(fp);
+    bool res = fread(&magic, sizeof(magic), 1, fp) == 1 && magic == LzFrame::MAGIC;
+    fseek(fp, pos, SEEK_SET);
+    return res;
+}
+
+inline bool CompressedReader::next(std::string& block)
+{
+    long pos = ftell(fp_);
+    LzFrame frame;
+    // a zero header is space allocated but not written yet
+    if (fread(&frame, sizeof(frame), 1, fp_) != 1 || frame.magic == 0)
+    {
+        clearerr(fp_);
+        fseek(fp_, pos, SEEK_SET);
+        return false;
+    }
+    ENFORCE(frame.magic == LzFrame::MAGIC)("Bad frame at offset ")(pos);
+    packed_.resize(frame.stored);
+    if (frame.stored && fread(&packed_[0], frame.stored, 1, fp_) != 1)
+    {
+        clearerr(fp_);
+        fseek(fp_, pos, SEEK_SET);
+        return false;
+    }
+    block.resize(frame.raw);
+    if (!(frame.flags & LzFrame::COMPRESSED))
+    {
+        block = packed_;
+        return true;
+    }
+    ENFORCE(lzDecompress(packed_.data(), packed_.size(), &block[0], block.size()) == frame.raw)
+        ("Bad frame at offset ")(pos);
+    return true;
+}
+
+#endif //__ALOGSINK_H__
@@ -0,0 +1,428 @@
+/*******************************************************************************
+ *                           Author: Petru Marginean                           *
+ *                          petru.marginean@gmail.com                          *
+ ******************************************************************************/
+
+/*
+  AsyncFileSink: the consumer fills fixed size buffers and hands them to the
+  kernel without waiting for the write to complete, so draining the queues
+  and the disk I/O overlap. Each buffer is written at its own file offset;
+  several buffers can be queued, but the writes complete in file order, so
+  the file only grows by complete buffers and a concurrent reader (alogcat -f)
+  never sees a hole of zeros left by a write still in flight.
+
+  The writes are submitted through io_uring (raw system calls, no liburing)
+  using registered buffers when possible; on kernels or sandboxes without
+  io_uring a small pool of pwrite() threads is used instead.
+*/
+
+#ifndef __ASYNCSINK_H__
+#define __ASYNCSINK_H__
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "alogsink.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#define ALOG_URING
+#endif
+#endif
+#endif
+
+struct AsyncWriter
+{
+    virtual ~AsyncWriter() {}
+    // starts writing len bytes of the buffer i at the given file offset
+    virtual void submit(std::size_t i, std::size_t len, off_t offset) = 0;
+    // stores the indexes of the buffers written so far in pDone, returns how many
+    virtual std::size_t reap(std::size_t* pDone, bool wait) = 0;
+};
+
+// completes a short write synchronously
+inline void writeAll(int fd, const char* pData, std::size_t len, off_t offset)
+{
+    while (len)
+    {
+        ssize_t n = pwrite(fd, pData, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        ENFORCE(n > 0)("pwrite() has failed: ")(strerror(errno));
+        pData += n;
+        len -= n;
+        offset += n;
+    }
+}
+
+#ifdef ALOG_URING
+
+struct UringWriter : AsyncWriter
+{
+    // throws if io_uring is not available
+    UringWriter(int fd, const std::vector<char*>& buffers, std::size_t size);
+    ~UringWriter();
+    virtual void submit(std::size_t i, std::size_t len, off_t offset);
+    virtual std::size_t reap(std::size_t* pDone, bool wait);
+private:
+    UringWriter(const UringWriter&);
+    int enter(unsigned submit, unsigned wait);
+private:
+    int fd_, ring_;
+    bool fixed_;
+    std::vector<iovec> iov_;
+    std::vector<std::size_t> len_;
+    std::vector<off_t> offset_;
+    void *pSq_, *pCq_;
+    std::size_t sqSize_, cqSize_, sqesSize_;
+    io_uring_sqe* pSqes_;
+    io_uring_cqe* pCqes_;
+    unsigned *sqTail_, *sqArray_, *cqHead_, *cqTail_;
+    unsigned sqMask_, cqMask_;
+};
+
+inline UringWriter::UringWriter(int fd, const std::vector<char*>& buffers, std::size_t size) :
+    fd_(fd), ring_(-1), fixed_(false), iov_(buffers.size()), len_(buffers.size()), offset_(buffers.size()),
+    pSq_(MAP_FAILED), pCq_(MAP_FAILED), pSqes_((io_uring_sqe*)MAP_FAILED)
+{
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring_ = syscall(__NR_io_uring_setup, buffers.size(), &p);
+    ENFORCE(ring_ >= 0)("io_uring_setup() has failed: ")(strerror(errno));
+    sqSize_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqSize_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sqSize_ = cqSize_ = std::max(sqSize_, cqSize_);
+    sqesSize_ = p.sq_entries * sizeof(io_uring_sqe);
+    pSq_ = mmap(0, sqSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_, IORING_OFF_SQ_RING);
+    ENFORCE(pSq_ != MAP_FAILED)("mmap() of the io_uring SQ has failed");
+    pCq_ = (p.features & IORING_FEAT_SINGLE_MMAP) ? pSq_ :
+        mmap(0, cqSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_, IORING_OFF_CQ_RING);
+    ENFORCE(pCq_ != MAP_FAILED)("mmap() of the io_uring CQ has failed");
+    pSqes_ = (io_uring_sqe*)mmap(0, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_, IORING_OFF_SQES);
+    ENFORCE(pSqes_ != MAP_FAILED)("mmap() of the io_uring SQEs has failed");
+    char* pSq = (char*)pSq_;
+    char* pCq = (char*)pCq_;
+    sqTail_ = (unsigned*)(pSq + p.sq_off.tail);
+    sqMask_ = *(unsigned*)(pSq + p.sq_off.ring_mask);
+    sqArray_ = (unsigned*)(pSq + p.sq_off.array);
+    cqHead_ = (unsigned*)(pCq + p.cq_off.head);
+    cqTail_ = (unsigned*)(pCq + p.cq_off.tail);
+    cqMask_ = *(unsigned*)(pCq + p.cq_off.ring_mask);
+    pCqes_ = (io_uring_cqe*)(pCq + p.cq_off.cqes);
+    for (std::size_t i = 0; i != buffers.size(); ++i)
+    {
+        iov_[i].iov_base = buffers[i];
+        iov_[i].iov_len = size;
+    }
+    // registered buffers save the kernel from mapping the pages on every write,
+    // but they count against RLIMIT_MEMLOCK; use plain writes if that fails
+    fixed_ = syscall(__NR_io_uring_register, ring_, IORING_REGISTER_BUFFERS, &iov_[0], iov_.size()) == 0;
+    FILE_LOG(logINFO) << "UringWriter::UringWriter(" << buffers.size() << " x " << size << "), registered buffers = " << fixed_;
+}
+
+inline UringWriter::~UringWriter()
+{
+    if (pSqes_ != MAP_FAILED)
+        munmap(pSqes_, sqesSize_);
+    if (pCq_ != MAP_FAILED && pCq_ != pSq_)
+        munmap(pCq_, cqSize_);
+    if (pSq_ != MAP_FAILED)
+        munmap(pSq_, sqSize_);
+    if (ring_ >= 0)
+        close(ring_);
+}
+
+inline int UringWriter::enter(unsigned submit, unsigned wait)
+{
+    int ret;
+    do
+    {
+        ret = syscall(__NR_io_uring_enter, ring_, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+    } while (ret < 0 && errno == EINTR);
+    ENFORCE(ret >= 0)("io_uring_enter() has failed: ")(strerror(errno));
+    return ret;
+}
+
+inline void UringWriter::submit(std::size_t i, std::size_t len, off_t offset)
+{
+    // there is one SQ entry per buffer, so the ring cannot be full
+    unsigned tail = *sqTail_;
+    unsigned index = tail & sqMask_;
+    io_uring_sqe& sqe = pSqes_[index];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.fd = fd_;
+    sqe.off = offset;
+    sqe.user_data = i;
+    sqe.flags = IOSQE_IO_DRAIN; // starts once the writes before it are done, keeps the file without holes
+    if (fixed_)
+    {
+        sqe.opcode = IORING_OP_WRITE_FIXED;
+        sqe.addr = (unsigned long)iov_[i].iov_base;
+        sqe.len = len;
+        sqe.buf_index = i;
+    }
+    else
+    {
+        iov_[i].iov_len = len;
+        sqe.opcode = IORING_OP_WRITEV;
+        sqe.addr = (unsigned long)&iov_[i];
+        sqe.len = 1;
+    }
+    len_[i] = len;
+    offset_[i] = offset;
+    sqArray_[index] = index;
+    __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+    enter(1, 0);
+}
+
+inline std::size_t UringWriter::reap(std::size_t* pDone, bool wait)
+{
+    unsigned head = *cqHead_;
+    if (wait && head == __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE))
+        enter(0, 1);
+    std::size_t n = 0;
+    for (unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE); head != tail; ++head)
+    {
+        const io_uring_cqe& cqe = pCqes_[head & cqMask_];
+        std::size_t i = cqe.user_data;
+        ENFORCE(cqe.res >= 0)("io_uring write has failed: ")(strerror(-cqe.res));
+        if ((std::size_t)cqe.res < len_[i])
+            writeAll(fd_, (const char*)iov_[i].iov_base + cqe.res, len_[i] - cqe.res, offset_[i] + cqe.res);
+        pDone[n++] = i;
+    }
+    __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+#endif //ALOG_URING
+
+struct ThreadPoolWriter : AsyncWriter
+{
+    // more than one thread can complete the writes out of order, leaving holes
+    // in the file that a concurrent reader would see as zeros
+    ThreadPoolWriter(int fd, const std::vector<char*>& buffers, std::size_t threads = 1);
+    ~ThreadPoolWriter();
+    virtual void submit(std::size_t i, std::size_t len, off_t offset);
+    virtual std::size_t reap(std::size_t* pDone, bool wait);
+private:
+    ThreadPoolWriter(const ThreadPoolWriter&);
+    void run();
+private:
+    struct Job
+    {
+        std::size_t i, len;
+        off_t offset;
+    };
+    int fd_;
+    std::vector<char*> buffers_;
+    std::deque<Job> jobs_;
+    std::vector<std::size_t> done_;
+    std::string error_;
+    std::mutex mutex_;
+    std::condition_variable jobReady_, jobDone_;
+    bool stopping_;
+    std::vector<std::thread> threads_;
+};
+
+inline ThreadPoolWriter::ThreadPoolWriter(int fd, const std::vector<char*>& buffers, std::size_t threads) :
+    fd_(fd), buffers_(buffers), stopping_(false)
+{
+    FILE_LOG(logINFO) << "ThreadPoolWriter::ThreadPoolWriter(" << buffers.size() << " buffers, " << threads << " threads)";
+    for (std::size_t i = 0; i != threads; ++i)
+        threads_.push_back(std::thread(&ThreadPoolWriter::run, this));
+}
+
+inline ThreadPoolWriter::~ThreadPoolWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    jobReady_.notify_all();
+    for (std::size_t i = 0; i != threads_.size(); ++i)
+        threads_[i].join();
+}
+
+inline void ThreadPoolWriter::submit(std::size_t i, std::size_t len, off_t offset)
+{
+    Job job = {i, len, offset};
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back(job);
+    }
+    jobReady_.notify_one();
+}
+
+inline std::size_t ThreadPoolWriter::reap(std::size_t* pDone, bool wait)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (wait)
+        jobDone_.wait(lock, [this] { return !done_.empty() || !error_.empty(); });
+    ENFORCE(error_.empty())(error_);
+    std::copy(done_.begin(), done_.end(), pDone);
+    std::size_t n = done_.size();
+    done_.clear();
+    return n;
+}
+
+inline void ThreadPoolWriter::run()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;)
+    {
+        jobReady_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+        if (jobs_.empty())
+            break;
+        Job job = jobs_.front();
+        jobs_.pop_front();
+        lock.unlock();
+        std::string error;
+        try
+        {
+            DefaultRaiser::Quiet quiet; // reap() throws it again on the consumer
+            writeAll(fd_, buffers_[job.i], job.len, job.offset);
+        }
+        catch (const std::exception& e)
+        {
+            error = e.what();
+        }
+        lock.lock();
+        done_.push_back(job.i);
+        if (!error.empty())
+            error_ = error;
+        jobDone_.notify_one();
+    }
+}
+
+struct AsyncFileSink : ALogSink
+{
+    AsyncFileSink(const std::string& fname, bool uring = true, std::size_t buffers = 8, std::size_t bufferSize = 256 * 1024);
+    ~AsyncFileSink();
+    virtual void write(const char* pData, std::size_t len);
+    virtual void flush();
+private:
+    AsyncFileSink(const AsyncFileSink&);
+    void submit();
+    void recycle(bool wait);
+private:
+    std::string fname_;
+    int fd_;
+    std::size_t size_, fill_, inflight_;
+    off_t offset_;
+    std::vector<char*> buffers_;
+    std::vector<std::size_t> free_, done_;
+    AsyncWriter* pWriter_;
+    char* pCurrent_;
+    std::size_t current_;
+};
+
+inline AsyncFileSink::AsyncFileSink(const std::string& fname, bool uring, std::size_t buffers, std::size_t bufferSize) :
+    fname_(fname), size_(bufferSize), fill_(0), inflight_(0), offset_(0), buffers_(buffers), done_(buffers),
+    pWriter_(0), pCurrent_(0), current_(0)
+{
+    FILE_LOG(logINFO) << "AsyncFileSink::AsyncFileSink('" << fname_ << "', " << buffers << " x " << size_ << ")";
+    ENFORCE(buffers > 0 && size_ > 0);
+    fd_ = open(fname_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ENFORCE(fd_ >= 0)("Cannot open '")(fname_)("': ")(strerror(errno));
+    for (std::size_t i = 0; i != buffers; ++i)
+    {
+        void* p = 0;
+        ENFORCE(posix_memalign(&p, 4096, size_) == 0);
+        buffers_[i] = (char*)p;
+        free_.push_back(buffers - 1 - i);
+    }
+#ifdef ALOG_URING
+    if (uring)
+    {
+        try
+        {
+            DefaultRaiser::Quiet quiet; // not a failure, there is a fallback
+            pWriter_ = new UringWriter(fd_, buffers_, size_);
+        }
+        catch (const std::exception& e)
+        {
+            FILE_LOG(logWARNING) << "io_uring is not available, using a thread pool instead: " << e.what();
+        }
+    }
+#endif
+    if (!pWriter_)
+        pWriter_ = new ThreadPoolWriter(fd_, buffers_);
+}
+
+inline AsyncFileSink::~AsyncFileSink()
+{
+    STD_FUNCTION_BEGIN;
+    flush();
+    while (inflight_)
+        recycle(true);
+    STD_FUNCTION_END;
+    delete pWriter_;
+    for (std::size_t i = 0; i != buffers_.size(); ++i)
+        free(buffers_[i]);
+    if (close(fd_) != 0)
+    {
+        FILE_LOG(logERROR) << "close('" << fname_ << "') has failed: " << strerror(errno);
+    }
+}
+
+inline void AsyncFileSink::write(const char* pData, std::size_t len)
+{
+    while (len)
+    {
+        if (!pCurrent_)
+        {
+            while (free_.empty()) // all the buffers are in flight, wait for the disk
+                recycle(true);
+            current_ = free_.back();
+            free_.pop_back();
+            pCurrent_ = buffers_[current_];
+            fill_ = 0;
+        }
+        std::size_t n = std::min(len, size_ - fill_);
+        memcpy(pCurrent_ + fill_, pData, n);
+        fill_ += n;
+        pData += n;
+        len -= n;
+        if (fill_ == size_)
+            submit();
+    }
+}
+
+inline void AsyncFileSink::flush()
+{
+    if (pCurrent_ && fill_)
+        submit();
+    if (inflight_)
+        recycle(false);
+}
+
+inline void AsyncFileSink::submit()
+{
+    pWriter_->submit(current_, fill_, offset_);
+    offset_ += fill_;
+    ++inflight_;
+    pCurrent_ = 0;
+    fill_ = 0;
+}
+
+inline void AsyncFileSink::recycle(bool wait)
+{
+    std::size_t n = pWriter_->reap(&done_[0], wait);
+    free_.insert(free_.end(), done_.begin(), done_.begin() + n);
+    inflight_ -= n;
+}
+
+#endif //__ASYNCSINK_H__
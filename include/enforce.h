@@ -38,8 +38,30 @@ struct DefaultRaiser
                       const char* locus
                       )
     {
+        if (OnThrow() && !Quiet::Depth())
+            OnThrow()(message + '\n' + locus);
         throw std::runtime_error(message + '\n' + locus);
     }
+
+    // optional hook called with the error text before throwing
+    static void (*&OnThrow())(const std::string&)
+    {
+        static void (*pHook)(const std::string&) = 0;
+        return pHook;
+    }
+
+    // the hook is not called while a Quiet lives on the throwing thread, for
+    // code that catches and handles its own failures
+    struct Quiet
+    {
+        Quiet() { ++Depth(); }
+        ~Quiet() { --Depth(); }
+        static int& Depth()
+        {
+            static thread_local int depth = 0;
+            return depth;
+        }
+    };
 };
 
 //
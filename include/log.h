@@ -26,6 +26,7 @@ class Log
  public:
     static TLogLevel& ReportingLevel();
     static void SetReportingLevel(const std::string& s); 
+    static void (*&OnError())(const std::string&); // optional hook called for every logERROR message
  protected:
     std::ostringstream os;
  private:
@@ -96,6 +97,13 @@ void Log<T>::SetReportingLevel(const std::string& s)
     ReportingLevel() = FromString(s);
 }
 
+template <typename T>
+void (*&Log<T>::OnError())(const std::string&)
+{
+    static void (*pHook)(const std::string&) = 0;
+    return pHook;
+}
+
 inline const char* const LogToString(TLogLevel level)
 {
     static const char* const  buffer[] = {"ERROR", "WARNING", "INFO", "DEBUG", "DEBUG1", "DEBUG2", 
@@ -141,6 +149,8 @@ Log<T>::~Log()
         tmp << "\n";
         T::Output(tmp.str());
     }
+    if (messageLevel == logERROR && OnError())
+        OnError()(os.str());
 }
 
 #endif
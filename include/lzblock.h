@@ -0,0 +1,137 @@
+/*******************************************************************************
+ *                           Author: Petru Marginean                           *
+ *                          petru.marginean@gmail.com                          *
+ ******************************************************************************/
+
+/*
+  Fast LZ77 block codec using the LZ4 block layout:
+    token (literal length << 4 | match length - 4), [extra literal length],
+    literals, 2 bytes little endian offset, [extra match length]
+  The last 5 bytes of a block are always literals and the last match starts
+  at least 12 bytes before the end of the block.
+*/
+
+#ifndef __LZBLOCK_H__
+#define __LZBLOCK_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <cstddef>
+#include "enforce.h"
+
+inline std::size_t lzCompressBound(std::size_t n)
+{
+    return n + n / 255 + 16;
+}
+
+inline uint32_t lzRead32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint8_t* lzWriteLength(uint8_t* op, std::size_t len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = static_cast<uint8_t>(len);
+    return op;
+}
+
+inline uint8_t* lzWriteSequence(uint8_t* op, const uint8_t* pLiterals, std::size_t literals,
+                                std::size_t offset, std::size_t match)
+{
+    uint8_t& token = *op++;
+    token = static_cast<uint8_t>((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15)
+        op = lzWriteLength(op, literals - 15);
+    memcpy(op, pLiterals, literals);
+    op += literals;
+    if (offset == 0) // last sequence, literals only
+        return op;
+    *op++ = static_cast<uint8_t>(offset);
+    *op++ = static_cast<uint8_t>(offset >> 8);
+    token |= static_cast<uint8_t>(match < 15 ? match : 15);
+    if (match >= 15)
+        op = lzWriteLength(op, match - 15);
+    return op;
+}
+
+// dst must have room for lzCompressBound(n) bytes; returns the compressed size
+inline std::size_t lzCompress(const char* source, std::size_t n, char* dest)
+{
+    const std::size_t MINMATCH = 4, LASTLITERALS = 5, MFLIMIT = 12, HASH_LOG = 12, MAX_OFFSET = 65535;
+    const uint8_t* src = reinterpret_cast<const uint8_t*>(source);
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* const end = src + n;
+    uint8_t* op = reinterpret_cast<uint8_t*>(dest);
+    if (n > MFLIMIT)
+    {
+        uint32_t table[1 << HASH_LOG] = {0};
+        const uint8_t* const mflimit = end - MFLIMIT;
+        const uint8_t* const matchlimit = end - LASTLITERALS;
+        while (ip < mflimit)
+        {
+            uint32_t seq = lzRead32(ip);
+            uint32_t h = (seq * 2654435761u) >> (32 - HASH_LOG);
+            const uint8_t* ref = src + table[h];
+            table[h] = static_cast<uint32_t>(ip - src);
+            if (ref >= ip || static_cast<std::size_t>(ip - ref) > MAX_OFFSET || lzRead32(ref) != seq)
+            {
+                ip += 1 + ((ip - anchor) >> 6); // skip faster over incompressible data
+                continue;
+            }
+            const uint8_t* p = ip + MINMATCH;
+            for (ref += MINMATCH; p < matchlimit && *p == *ref; ++p, ++ref);
+            op = lzWriteSequence(op, anchor, ip - anchor, p - ref, p - ip - MINMATCH);
+            ip = anchor = p;
+        }
+    }
+    op = lzWriteSequence(op, anchor, end - anchor, 0, 0);
+    return op - reinterpret_cast<uint8_t*>(dest);
+}
+
+// returns the decompressed size; throws if the block is malformed or does not fit in cap bytes
+inline std::size_t lzDecompress(const char* source, std::size_t n, char* dest, std::size_t cap)
+{
+    const uint8_t* ip = reinterpret_cast<const uint8_t*>(source);
+    const uint8_t* const end = ip + n;
+    uint8_t* const dst = reinterpret_cast<uint8_t*>(dest);
+    uint8_t* op = dst;
+    uint8_t* const oend = dst + cap;
+    while (ip < end)
+    {
+        unsigned token = *ip++;
+        std::size_t literals = token >> 4;
+        if (literals == 15)
+            for (unsigned b = 255; b == 255; literals += b)
+            {
+                ENFORCE(ip < end)("Corrupted lz block");
+                b = *ip++;
+            }
+        ENFORCE(literals <= std::size_t(end - ip) && literals <= std::size_t(oend - op))("Corrupted lz block");
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == end)
+            break;
+        ENFORCE(end - ip >= 2)("Corrupted lz block");
+        std::size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        std::size_t match = (token & 15) + 4;
+        if ((token & 15) == 15)
+            for (unsigned b = 255; b == 255; match += b)
+            {
+                ENFORCE(ip < end)("Corrupted lz block");
+                b = *ip++;
+            }
+        ENFORCE(offset != 0 && offset <= std::size_t(op - dst) && match <= std::size_t(oend - op))("Corrupted lz block");
+        for (const uint8_t* ref = op - offset; match; --match) // byte copy: the match may overlap
+            *op++ = *ref++;
+    }
+    return op - dst;
+}
+
+#endif //__LZBLOCK_H__
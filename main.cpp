@@ -29,6 +29,17 @@ void setaffinity(int i)
     ENFORCE(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) == 0);
 }
 
+struct Quote
+{
+    double bid, ask;
+    unsigned int size;
+};
+
+std::ostream& operator <<(std::ostream& o, const Quote& q)
+{
+    return o << "{" << q.bid << " / " << q.ask << " x " << q.size << "}";
+}
+
 ALog aLog;
 ALog* const ALog::pALog = &aLog;
 
@@ -36,6 +47,7 @@ int main(int argc, char* argv[])
 {
     STD_FUNCTION_BEGIN;
     SCOPE_EXIT(foo(true));
+    ALog::get().addType<Quote>("Quote");
     ALog::get().init(1000000, 256, "/tmp/test.log");
     setaffinity(11);
     accelerate();
@@ -51,6 +63,7 @@ int main(int argc, char* argv[])
     {
         ALOG << "Hello1" << " World " << 3.2 << " blabla " << i;
         ALOG << "Hello2" << " World " << 3.2 << " blabla " << i;
+        ALOG << "Quote " << Quote{3.2, 3.3, 100};
         usleep(1000000);
     }
     FILE_LOG(logINFO) << "Finishing logging " << NUM << " messages";